@@ -0,0 +1,82 @@
+/**
+ * assignment.cpp
+ */
+
+#include "assignment.h"
+
+#include <math.h>
+
+using std::vector;
+
+
+void AssignmentSolver::Solve(const vector<double>& cost, int rows, int cols,
+                             vector<int>& row_to_col) {
+  // Index 0 of the column arrays is a virtual column that the row being
+  //   inserted starts from; rows and columns are 1 based below
+  u.assign(rows + 1, 0.0);
+  v.assign(cols + 1, 0.0);
+  col_row.assign(cols + 1, 0);
+  way.assign(cols + 1, 0);
+
+  for (int i=1; i<=rows; i++)
+  {
+    // Grow a shortest path tree from row i until it reaches a free column
+    col_row[0] = i;
+    int j0 = 0;
+    min_slack.assign(cols + 1, HUGE_VAL);
+    used.assign(cols + 1, 0);
+    do
+    {
+      used[j0] = 1;
+      int i0 = col_row[j0];
+      double delta = HUGE_VAL;
+      int j1 = 0;
+      for (int j=1; j<=cols; j++)
+      {
+        if (used[j]) {
+          continue;
+        }
+        double slack = cost[(i0 - 1) * cols + (j - 1)] - u[i0] - v[j];
+        if (slack < min_slack[j])
+        {
+          min_slack[j] = slack;
+          way[j] = j0;
+        }
+        if (min_slack[j] < delta)
+        {
+          delta = min_slack[j];
+          j1 = j;
+        }
+      }
+      for (int j=0; j<=cols; j++)
+      {
+        if (used[j])
+        {
+          u[col_row[j]] += delta;
+          v[j] -= delta;
+        }
+        else
+        {
+          min_slack[j] -= delta;
+        }
+      }
+      j0 = j1;
+    } while (col_row[j0] != 0);
+
+    // Flip the matching along the path
+    do
+    {
+      int j1 = way[j0];
+      col_row[j0] = col_row[j1];
+      j0 = j1;
+    } while (j0 != 0);
+  }
+
+  row_to_col.assign(rows, -1);
+  for (int j=1; j<=cols; j++)
+  {
+    if (col_row[j] > 0) {
+      row_to_col[col_row[j] - 1] = j - 1;
+    }
+  }
+}
@@ -0,0 +1,38 @@
+/**
+ * assignment.h
+ * Minimum cost assignment of observations to landmarks.
+ *
+ * Hungarian method with row and column potentials and shortest augmenting
+ * paths (O(rows^2 cols)). The problems solved here are the gated
+ * observation / landmark graphs of one particle, a few dozen nodes, so a
+ * dense cost matrix is cheaper than a sparse representation.
+ */
+
+#ifndef ASSIGNMENT_H_
+#define ASSIGNMENT_H_
+
+#include <vector>
+
+class AssignmentSolver {
+ public:
+  /**
+   * Assign every row to a distinct column minimizing the total cost.
+   * @param cost Row major rows x cols cost matrix, rows <= cols
+   * @param rows Number of rows
+   * @param cols Number of columns
+   * @param row_to_col Receives the column of every row
+   */
+  void Solve(const std::vector<double>& cost, int rows, int cols,
+             std::vector<int>& row_to_col);
+
+ private:
+  // Work arrays, kept between calls so their capacity is reused
+  std::vector<double> u;
+  std::vector<double> v;
+  std::vector<double> min_slack;
+  std::vector<int> col_row;
+  std::vector<int> way;
+  std::vector<char> used;
+};
+
+#endif  // ASSIGNMENT_H_
@@ -0,0 +1,867 @@
+/**
+ * benchmark.cpp
+ * Offline replay driver and stress benchmark for the particle filter.
+ *
+ * A vehicle drives laps of an ellipse through the map. Ground truth,
+ * noiseless controls and noisy landmark observations are generated the way
+ * the simulator provides them and replayed through the filter, timing every
+ * stage. No simulator or uWebSocketIO is needed.
+ *
+ * Usage: pf_benchmark [--frames N] [--threads N] [--seed N]
+ *                     [--global N] [--density] [--kld MIN MAX]
+ *                     [--deadline MS] [--kidnap FRAME] [--amcl] [--hybrid]
+ *                     [--basic] [--float] [--field RES MB]
+ *                     [--particles N] [--assign] [--prune MARGIN]
+ *                     [--two-stage FRACTION] [--dense K] [--max-obs N]
+ *                     [--hilbert] [--multiplicity] [--aux] [--fleet S]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "fleet_engine.h"
+#include "parallel.h"
+#include "particle_filter.h"
+#include "particle_filter_t.h"
+
+using std::string;
+using std::vector;
+
+// One replayed telemetry frame
+struct Frame {
+  ground_truth gt;
+  control_s control;  // Control from the previous frame to this one
+  vector<LandmarkObs> observations;
+};
+
+struct BenchConfig {
+  int frames;             // Number of frames, 0 for one lap
+  int threads;            // Worker threads of the filter
+  unsigned seed;          // Seed of the simulated noise
+  int global_particles;   // > 0 starts with global localization
+  bool density_weighted;  // Density weighted global initialization
+  int kld_min;            // KLD-sampling limits, disabled if kld_max is 0
+  int kld_max;
+  double deadline_ms;     // Step latency budget, 0 for none
+  int kidnap_frame;       // Frame at which the vehicle is teleported, or -1
+  bool augmented_mcl;     // Augmented MCL kidnap recovery
+  bool hybrid;            // Hybrid EKF / particle filter mode
+  bool basic;             // Replay through BasicParticleFilter instead
+  bool compare_float;     // Compare FloatParticleFilter with BasicParticleFilter
+  double field_res;       // Likelihood field spacing [m], 0 for exact weighting
+  int field_mb;           // Likelihood field memory bound [MB]
+  int particles;          // Particles of init(), 0 for the filter default
+  bool assignment;        // Gated global nearest neighbour association
+  double prune_margin;    // Early termination margin, 0 to weight fully
+  double two_stage;       // Fraction weighted exactly, 0 for single stage
+  int dense;              // Detections per landmark in range
+  int max_obs;            // Observation limit of the filter, 0 for none
+  bool hilbert;           // Hilbert curve particle order
+  bool multiplicity;      // Multiplicity encoded resampled sets
+  bool auxiliary;         // Auxiliary particle filter steps
+  int fleet;              // Sessions of the fleet comparison, 0 for none
+};
+
+// Best particle of every frame of a policy filter replay, and its run time
+struct PolicyRun {
+  vector<double> x, y, theta;
+  double ms;
+};
+
+// Heap allocations of the process, counted by the replaced operator new.
+//   Every allocating form counts and takes its memory from std::malloc,
+//   every form of operator delete returns it with std::free.
+static std::atomic<long long> g_allocations(0);
+
+static void* CountedAlloc(size_t size) {
+  g_allocations++;
+  void* p = std::malloc(size > 0 ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+static void* CountedAllocNoThrow(size_t size) noexcept {
+  g_allocations++;
+  return std::malloc(size > 0 ? size : 1);
+}
+
+void* operator new(size_t size) {
+  return CountedAlloc(size);
+}
+
+void* operator new[](size_t size) {
+  return CountedAlloc(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocNoThrow(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+  return CountedAllocNoThrow(size);
+}
+
+void operator delete(void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  std::free(p);
+}
+
+#ifdef __cpp_aligned_new
+// Over-aligned types (C++17 and later)
+static void* CountedAlignedAlloc(size_t size, std::align_val_t alignment) {
+  g_allocations++;
+  void* p = NULL;
+  if (posix_memalign(&p, std::max((size_t)alignment, sizeof(void*)), size > 0 ? size : 1) != 0) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+  return CountedAlignedAlloc(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+#endif
+
+/**
+ * Hardware cache misses of the process (perf_event, Linux), including
+ *   the worker threads it starts. Unavailable without kernel support or
+ *   permission.
+ */
+class CacheMissCounter {
+ public:
+  CacheMissCounter() : fd(-1) {
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  ~CacheMissCounter() {
+#ifdef __linux__
+    if (fd >= 0) {
+      close(fd);
+    }
+#endif
+  }
+
+  bool Available() const { return fd >= 0; }
+
+  // Misses counted so far, 0 if unavailable
+  long long Read() const {
+    long long count = 0;
+#ifdef __linux__
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+      count = 0;
+    }
+#endif
+    return count;
+  }
+
+ private:
+  int fd;
+};
+
+// Frames before allocations are counted, while buffers reach their size
+static const int kWarmupFrames = 10;
+
+// Distance along the track the vehicle is teleported by [rad of phi]
+static const double kKidnapPhi = M_PI / 2.0;
+
+// Parameters as used by main.cpp
+static const double kDeltaT = 0.1;
+static const double kSensorRange = 50;
+static double sigma_pos[3] = {0.3, 0.3, 0.01};
+static double sigma_landmark[2] = {0.3, 0.3};
+
+// Ellipse driven by the simulated vehicle [m], and its speed [m/s]
+static const double kTrackCx = 125.0;
+static const double kTrackCy = -10.0;
+static const double kTrackA = 140.0;
+static const double kTrackB = 25.0;
+static const double kSpeed = 10.0;
+
+static double NormalizeAngle(double a) {
+  return a - 2.0 * M_PI * floor((a + M_PI) / (2.0 * M_PI));
+}
+
+/**
+ * Simulate ground truth, controls and observations along the track.
+ */
+static vector<Frame> GenerateScenario(const Map& map, const BenchConfig& cfg) {
+  std::mt19937 gen(cfg.seed);
+  std::normal_distribution<double> noise_x(0.0, sigma_landmark[0]);
+  std::normal_distribution<double> noise_y(0.0, sigma_landmark[1]);
+
+  vector<Frame> frames;
+  double phi = 0.0;
+  int numFrames = cfg.frames;
+  bool oneLap = numFrames <= 0;
+  for (int t=0; oneLap ? phi < 2.0 * M_PI : t < numFrames; t++)
+  {
+    bool kidnapped = t == cfg.kidnap_frame;
+    if (kidnapped)
+    {
+      phi += kKidnapPhi;
+    }
+
+    Frame f;
+    double tx = -kTrackA * sin(phi);
+    double ty = kTrackB * cos(phi);
+    f.gt.x = kTrackCx + kTrackA * cos(phi);
+    f.gt.y = kTrackCy + kTrackB * sin(phi);
+    f.gt.theta = atan2(ty, tx);
+    phi += kSpeed * kDeltaT / sqrt(tx * tx + ty * ty);
+
+    f.control.velocity = 0.0;
+    f.control.yawrate = 0.0;
+    if (kidnapped)
+    {
+      // The controls do not know about the teleport
+      f.control = frames.back().control;
+    }
+    else if (!frames.empty())
+    {
+      const ground_truth& prev = frames.back().gt;
+      f.control.velocity = dist(prev.x, prev.y, f.gt.x, f.gt.y) / kDeltaT;
+      f.control.yawrate = NormalizeAngle(f.gt.theta - prev.theta) / kDeltaT;
+    }
+
+    for (const auto& lm : map.landmark_list)
+    {
+      double dx = lm.x_f - f.gt.x;
+      double dy = lm.y_f - f.gt.y;
+      for (int k=0; k<cfg.dense && sqrt(dx * dx + dy * dy) < kSensorRange; k++)
+      {
+        LandmarkObs obs;
+        obs.id = -1;
+        obs.x = cos(f.gt.theta) * dx + sin(f.gt.theta) * dy + noise_x(gen);
+        obs.y = -sin(f.gt.theta) * dx + cos(f.gt.theta) * dy + noise_y(gen);
+        f.observations.push_back(obs);
+      }
+    }
+    frames.push_back(f);
+  }
+  return frames;
+}
+
+static double Millis(std::chrono::steady_clock::time_point a,
+                     std::chrono::steady_clock::time_point b) {
+  return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+/**
+ * Replay through a policy based filter (particle_filter_t.h) and report its
+ *   error and timing.
+ */
+template <class Filter>
+static PolicyRun RunPolicyFilter(const char* name, const Map& map, const vector<Frame>& frames,
+                                 const BenchConfig& cfg) {
+  Filter pf(cfg.particles > 0 ? cfg.particles : 100);
+  pf.SetNumThreads(cfg.threads);
+
+  PolicyRun run;
+  double tPredict = 0.0, tUpdate = 0.0, tResample = 0.0;
+  double errBest[3] = {0.0, 0.0, 0.0};
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    auto t0 = std::chrono::steady_clock::now();
+    if (!pf.initialized()) {
+      pf.init(f.gt.x, f.gt.y, f.gt.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.control.velocity, f.control.yawrate);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    auto t2 = std::chrono::steady_clock::now();
+    int best = pf.BestIndex();
+    run.x.push_back(pf.x[best]);
+    run.y.push_back(pf.y[best]);
+    run.theta.push_back(pf.theta[best]);
+    double* err = getError(f.gt.x, f.gt.y, f.gt.theta, pf.x[best], pf.y[best], pf.theta[best]);
+    for (int k=0; k<3; k++) {
+      errBest[k] += err[k];
+    }
+    pf.resample();
+    auto t3 = std::chrono::steady_clock::now();
+
+    tPredict += Millis(t0, t1);
+    tUpdate += Millis(t1, t2);
+    tResample += Millis(t2, t3);
+  }
+  run.ms = tPredict + tUpdate + tResample;
+
+  double n = (double)frames.size();
+  printf("filter             %s\n", name);
+  printf("frames             %d\n", (int)frames.size());
+  printf("threads            %d\n", cfg.threads);
+  printf("particles          %d\n", pf.size());
+  printf("error best x/y/yaw %.3f %.3f %.4f\n", errBest[0] / n, errBest[1] / n, errBest[2] / n);
+  printf("ms/frame predict   %.4f\n", tPredict / n);
+  printf("ms/frame update    %.4f\n", tUpdate / n);
+  printf("ms/frame resample  %.4f\n", tResample / n);
+  printf("ms/frame total     %.4f\n", run.ms / n);
+  return run;
+}
+
+/**
+ * Replay the frames in double and in float precision and report how far
+ *   the float estimates are from the double ones. The two runs draw
+ *   different noise and resampling picks, so the distance includes the
+ *   spread of the posterior; the error to ground truth is the accuracy check.
+ */
+static void CompareFloat(const Map& map, const vector<Frame>& frames, const BenchConfig& cfg) {
+  PolicyRun ref = RunPolicyFilter<BasicParticleFilter>("BasicParticleFilter (double)", map, frames, cfg);
+  printf("\n");
+  PolicyRun run = RunPolicyFilter<FloatParticleFilter>("FloatParticleFilter (float)", map, frames, cfg);
+
+  double errSum[3] = {0.0, 0.0, 0.0};
+  double errMax[3] = {0.0, 0.0, 0.0};
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    double* err = getError(ref.x[t], ref.y[t], ref.theta[t], run.x[t], run.y[t], run.theta[t]);
+    for (int k=0; k<3; k++) {
+      errSum[k] += err[k];
+      errMax[k] = std::max(errMax[k], err[k]);
+    }
+  }
+  double n = (double)frames.size();
+  printf("\nfloat vs double\n");
+  printf("error avg x/y/yaw  %.3g %.3g %.3g\n", errSum[0] / n, errSum[1] / n, errSum[2] / n);
+  printf("error max x/y/yaw  %.3g %.3g %.3g\n", errMax[0], errMax[1], errMax[2]);
+  printf("speedup            %.2f\n", run.ms > 0.0 ? ref.ms / run.ms : 0.0);
+}
+
+/**
+ * Compare the likelihood field with the exact model at the observations
+ *   transformed by the ground truth pose: nearest landmark in sensor range
+ *   and Gaussian log-likelihood.
+ */
+static void CompareLikelihoodField(const LikelihoodField& field, const Map& map,
+                                   const vector<Frame>& frames) {
+  double errSum = 0.0, errMax = 0.0;
+  long long count = 0;
+  for (const Frame& f : frames)
+  {
+    for (const LandmarkObs& obs : f.observations)
+    {
+      double x = f.gt.x + cos(f.gt.theta) * obs.x - sin(f.gt.theta) * obs.y;
+      double y = f.gt.y + sin(f.gt.theta) * obs.x + cos(f.gt.theta) * obs.y;
+      double minDist = HUGE_VAL;
+      double exact = -HUGE_VAL;
+      for (const auto& lm : map.landmark_list)
+      {
+        double d = dist(x, y, lm.x_f, lm.y_f);
+        if (dist(f.gt.x, f.gt.y, lm.x_f, lm.y_f) < kSensorRange && d < minDist)
+        {
+          minDist = d;
+          exact = log_multiv_prob(sigma_landmark[0], sigma_landmark[1], x, y, lm.x_f, lm.y_f);
+        }
+      }
+      double err = fabs(field.LogLikelihood(x, y) - exact);
+      errSum += err;
+      errMax = std::max(errMax, err);
+      count++;
+    }
+  }
+  printf("field resolution   %.3f m, %.1f MB\n", field.Resolution(), field.MemoryBytes() / 1048576.0);
+  printf("field log-lik error avg/max %.4f / %.4f\n", count > 0 ? errSum / count : 0.0, errMax);
+}
+
+// Replays of each fleet mode; the fastest counts, as the sandbox timing is noisy
+static const int kFleetRepeats = 3;
+
+/**
+ * Replay one scenario per session, seeded seed, seed+1, ..., through
+ *   separate filters stepped in parallel over the sessions, or through one
+ *   FleetEngine batch. Returns the time of the frames after the first
+ *   weighted one, which builds the fields, in the fastest of
+ *   kFleetRepeats replays, and reports it per frame with the mean
+ *   position error after the first frame.
+ */
+static double RunFleet(const char* name, const Map& map, const vector<vector<Frame> >& scenarios,
+                       const BenchConfig& cfg, bool batched) {
+  const int numSessions = (int)scenarios.size();
+  const double fieldRes = cfg.field_res > 0.0 ? cfg.field_res : 0.1;
+  const size_t fieldBytes = (size_t)cfg.field_mb * 1024 * 1024;
+  const size_t numFrames = scenarios[0].size();
+  WorkerPool workers;
+  workers.Resize(cfg.threads);
+
+  double bestMs = HUGE_VAL;
+  double errSum = 0.0;
+  size_t fieldMemory = 0;
+  int batchedSessions = 0;
+  for (int rep=0; rep<kFleetRepeats; rep++)
+  {
+    vector<ParticleFilter> filters(numSessions);
+    for (auto& pf : filters)
+    {
+      pf.SetNumParticles(cfg.particles > 0 ? cfg.particles : 100);
+      pf.SetLikelihoodField(true, fieldRes, fieldBytes);
+    }
+    FleetEngine engine;
+    engine.SetNumThreads(cfg.threads);
+    engine.SetLikelihoodField(fieldRes, fieldBytes);
+    vector<FleetSession> sessions(numSessions);
+
+    double ms = 0.0;
+    errSum = 0.0;
+    for (size_t t=0; t<numFrames; t++)
+    {
+      auto t0 = std::chrono::steady_clock::now();
+      if (t == 0) {
+        // Weighting starts with the second frame, so the batched filters
+        //   build no fields of their own
+        for (int s=0; s<numSessions; s++) {
+          const Frame& f = scenarios[s][0];
+          filters[s].init(f.gt.x, f.gt.y, f.gt.theta, sigma_pos);
+        }
+        continue;
+      } else if (batched) {
+        for (int s=0; s<numSessions; s++) {
+          const Frame& f = scenarios[s][t];
+          sessions[s].filter = &filters[s];
+          sessions[s].velocity = f.control.velocity;
+          sessions[s].yaw_rate = f.control.yawrate;
+          sessions[s].observations = &f.observations;
+        }
+        engine.Step(sessions, kDeltaT, sigma_pos, kSensorRange, sigma_landmark, map);
+        engine.Resample(sessions);
+      } else {
+        ParallelFor(numSessions, 1, workers, [&](int block, int begin, int end) {
+          for (int s=begin; s<end; s++) {
+            const Frame& f = scenarios[s][t];
+            filters[s].prediction(kDeltaT, sigma_pos, f.control.velocity, f.control.yawrate);
+            filters[s].updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+            filters[s].resample();
+          }
+        });
+      }
+      if (t > 1) {
+        ms += Millis(t0, std::chrono::steady_clock::now());
+      }
+      for (int s=0; s<numSessions; s++) {
+        const ground_truth& gt = scenarios[s][t].gt;
+        PoseEstimate estimate = filters[s].GetPoseEstimate();
+        double* err = getError(gt.x, gt.y, gt.theta, estimate.x, estimate.y, estimate.theta);
+        errSum += 0.5 * (err[0] + err[1]);
+      }
+    }
+    bestMs = std::min(bestMs, ms);
+
+    fieldMemory = engine.GetLikelihoodField().MemoryBytes();
+    for (const auto& pf : filters)
+    {
+      fieldMemory += pf.GetLikelihoodField().MemoryBytes();
+    }
+    batchedSessions = engine.BatchedSessions();
+  }
+
+  double frames = (double)std::max((size_t)1, numFrames - 2);
+  printf("%s\n", name);
+  if (batched) {
+    printf("batched sessions   %d of %d\n", batchedSessions, numSessions);
+  }
+  printf("field memory       %.1f MB\n", fieldMemory / 1048576.0);
+  printf("ms/frame total     %.4f\n", bestMs / frames);
+  printf("us/session/frame   %.2f\n", 1000.0 * bestMs / frames / numSessions);
+  printf("error mean x/y avg %.3f\n", errSum / (std::max((size_t)1, numFrames - 1) * numSessions));
+  return bestMs;
+}
+
+static void CompareFleet(const Map& map, const BenchConfig& cfg) {
+  vector<vector<Frame> > scenarios;
+  for (int s=0; s<cfg.fleet; s++)
+  {
+    BenchConfig sessionCfg = cfg;
+    sessionCfg.seed = cfg.seed + s;
+    scenarios.push_back(GenerateScenario(map, sessionCfg));
+  }
+  printf("sessions           %d\n", cfg.fleet);
+  printf("threads            %d\n", cfg.threads);
+  double separate = RunFleet("separate filters", map, scenarios, cfg, false);
+  double batched = RunFleet("fleet engine", map, scenarios, cfg, true);
+  printf("speedup            %.2f\n", batched > 0.0 ? separate / batched : 0.0);
+}
+
+static void Usage() {
+  printf("Usage: pf_benchmark [--frames N] [--threads N] [--seed N]\n"
+         "                    [--global N] [--density] [--kld MIN MAX]\n"
+         "                    [--deadline MS] [--kidnap FRAME] [--amcl] [--hybrid]\n"
+         "                    [--basic] [--float] [--field RES MB]\n"
+         "                    [--particles N] [--assign] [--prune MARGIN]\n"
+         "                    [--two-stage FRACTION] [--dense K] [--max-obs N]\n"
+         "                    [--hilbert] [--multiplicity] [--aux] [--fleet S]\n"
+         "  --frames N   Number of frames to replay (default: one lap)\n"
+         "  --threads N  Worker threads of the filter (default: 1)\n"
+         "  --seed N     Seed of the simulated sensor noise (default: 1)\n"
+         "  --global N   Global localization starting with N particles\n"
+         "  --density    Weight global initialization by landmark density\n"
+         "  --kld MIN MAX  KLD-sampling between MIN and MAX particles\n"
+         "  --deadline MS  Latency budget per step, shedding particles\n"
+         "  --kidnap FRAME Teleport the vehicle a quarter lap ahead at FRAME\n"
+         "  --amcl       Augmented MCL kidnap detection and recovery\n"
+         "  --hybrid     Switch to an EKF while the posterior is unimodal\n"
+         "  --basic      Replay through the policy based BasicParticleFilter\n"
+         "  --float      Compare the float and double policy based filters\n"
+         "  --field RES MB Weight by a likelihood field with RES m spacing,\n"
+         "               at most MB megabytes, and compare it with the exact model\n"
+         "  --particles N Particles of the position initialization\n"
+         "  --assign     Associate by gated minimum cost assignment\n"
+         "  --prune MARGIN Stop weighting particles MARGIN below the best log weight\n"
+         "  --two-stage FRACTION Weight FRACTION of the particles exactly, drawn\n"
+         "               by a coarse likelihood field\n"
+         "  --dense K    Simulate a dense sensor with K detections per landmark\n"
+         "  --max-obs N  Weight with at most N observations, spread by bearing\n"
+         "  --hilbert    Store the particles in Hilbert curve order\n"
+         "  --multiplicity Store resampled copies as (parent, count) until prediction\n"
+         "  --aux        Auxiliary particle filter steps, timed as update\n"
+         "  --fleet S    Compare S separate filters with one FleetEngine batch,\n"
+         "               weighting by the likelihood field of --field\n");
+}
+
+int main(int argc, char* argv[]) {
+  BenchConfig cfg = {0, 1, 1, 0, false, 0, 0, 0.0, -1, false, false, false, false, 0.0, 64, 0, false, 0.0, 0.0, 1, 0, false, false, false, 0};
+
+  for (int i=1; i<argc; i++)
+  {
+    string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--frames" && hasValue) {
+      cfg.frames = atoi(argv[++i]);
+    } else if (arg == "--threads" && hasValue) {
+      cfg.threads = atoi(argv[++i]);
+    } else if (arg == "--seed" && hasValue) {
+      cfg.seed = (unsigned)atoi(argv[++i]);
+    } else if (arg == "--global" && hasValue) {
+      cfg.global_particles = atoi(argv[++i]);
+    } else if (arg == "--density") {
+      cfg.density_weighted = true;
+    } else if (arg == "--kld" && i + 2 < argc) {
+      cfg.kld_min = atoi(argv[++i]);
+      cfg.kld_max = atoi(argv[++i]);
+    } else if (arg == "--deadline" && hasValue) {
+      cfg.deadline_ms = atof(argv[++i]);
+    } else if (arg == "--kidnap" && hasValue) {
+      cfg.kidnap_frame = atoi(argv[++i]);
+    } else if (arg == "--amcl") {
+      cfg.augmented_mcl = true;
+    } else if (arg == "--hybrid") {
+      cfg.hybrid = true;
+    } else if (arg == "--basic") {
+      cfg.basic = true;
+    } else if (arg == "--float") {
+      cfg.compare_float = true;
+    } else if (arg == "--field" && i + 2 < argc) {
+      cfg.field_res = atof(argv[++i]);
+      cfg.field_mb = atoi(argv[++i]);
+    } else if (arg == "--particles" && hasValue) {
+      cfg.particles = atoi(argv[++i]);
+    } else if (arg == "--assign") {
+      cfg.assignment = true;
+    } else if (arg == "--prune" && hasValue) {
+      cfg.prune_margin = atof(argv[++i]);
+    } else if (arg == "--two-stage" && hasValue) {
+      cfg.two_stage = atof(argv[++i]);
+    } else if (arg == "--dense" && hasValue) {
+      cfg.dense = std::max(1, atoi(argv[++i]));
+    } else if (arg == "--max-obs" && hasValue) {
+      cfg.max_obs = atoi(argv[++i]);
+    } else if (arg == "--hilbert") {
+      cfg.hilbert = true;
+    } else if (arg == "--multiplicity") {
+      cfg.multiplicity = true;
+    } else if (arg == "--aux") {
+      cfg.auxiliary = true;
+    } else if (arg == "--fleet" && hasValue) {
+      cfg.fleet = std::max(1, atoi(argv[++i]));
+    } else {
+      Usage();
+      return arg == "--help" ? 0 : -1;
+    }
+  }
+
+  Map map;
+  if (!read_map_data("../data/map_data.txt", map) &&
+      !read_map_data("data/map_data.txt", map)) {
+    printf("Error: Could not open map file\n");
+    return -1;
+  }
+
+  vector<Frame> frames = GenerateScenario(map, cfg);
+  if (cfg.compare_float) {
+    CompareFloat(map, frames, cfg);
+    return 0;
+  }
+  if (cfg.fleet > 0) {
+    CompareFleet(map, cfg);
+    return 0;
+  }
+  if (cfg.basic) {
+    RunPolicyFilter<BasicParticleFilter>("BasicParticleFilter", map, frames, cfg);
+    return 0;
+  }
+
+  ParticleFilter pf;
+  pf.SetNumThreads(cfg.threads);
+  if (cfg.kld_max > 0) {
+    KldConfig kld;
+    kld.min_particles = cfg.kld_min;
+    kld.max_particles = cfg.kld_max;
+    pf.SetKldSampling(true, kld);
+  }
+  pf.SetStepDeadline(cfg.deadline_ms);
+  pf.SetAugmentedMcl(cfg.augmented_mcl);
+  pf.SetHybridEkf(cfg.hybrid);
+  if (cfg.field_res > 0.0) {
+    pf.SetLikelihoodField(true, cfg.field_res, (size_t)cfg.field_mb * 1024 * 1024);
+  }
+  if (cfg.particles > 0) {
+    pf.SetNumParticles(cfg.particles);
+  }
+  pf.SetAssignmentAssociation(cfg.assignment);
+  if (cfg.prune_margin > 0.0) {
+    pf.SetEarlyTermination(true, cfg.prune_margin);
+  }
+  if (cfg.two_stage > 0.0) {
+    pf.SetTwoStageWeighting(true, cfg.two_stage);
+  }
+  pf.SetObservationLimit(cfg.max_obs);
+  pf.SetSpatialOrdering(cfg.hilbert);
+  pf.SetMultiplicityEncoding(cfg.multiplicity);
+
+  double tPredict = 0.0, tUpdate = 0.0, tResample = 0.0;
+  double tFirstUpdate = 0.0;
+  double errBest[3] = {0.0, 0.0, 0.0};
+  double errMean[3] = {0.0, 0.0, 0.0};
+  double hitRate = 0.0;
+  int convergedFrame = -1;
+  int recoveredFrame = -1;
+  int injected = 0;
+  size_t maxParticles = 0;
+  double sumParticles = 0.0;
+  double sumReached = 0.0, sumShed = 0.0;
+  double sumStepMs = 0.0, maxStepMs = 0.0;
+  double sumSolves = 0.0, sumSolverMs = 0.0;
+  double sumPruned = 0.0, sumSkipped = 0.0;
+  double sumStored = 0.0;
+  long long allocs[3] = {0, 0, 0};
+  CacheMissCounter cacheMisses;
+  long long misses[3] = {0, 0, 0};
+
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    long long a0 = g_allocations;
+    long long m0 = cacheMisses.Read();
+    auto t0 = std::chrono::steady_clock::now();
+    bool auxStep = cfg.auxiliary && pf.initialized();
+    if (auxStep) {
+      // Predicts, weights and resamples in one step below
+    } else if (!pf.initialized()) {
+      if (cfg.global_particles > 0) {
+        pf.InitGlobal(map, kSensorRange, cfg.global_particles, 100, cfg.density_weighted);
+      } else {
+        pf.init(f.gt.x, f.gt.y, f.gt.theta, sigma_pos);
+      }
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.control.velocity, f.control.yawrate);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    long long a1 = g_allocations;
+    long long m1 = cacheMisses.Read();
+    if (auxStep) {
+      pf.AuxiliaryStep(kDeltaT, sigma_pos, f.control.velocity, f.control.yawrate,
+                       kSensorRange, sigma_landmark, f.observations, map);
+    } else {
+      pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    long long a2 = g_allocations;
+    long long m2 = cacheMisses.Read();
+    // Estimates of the weighted set, before resampling makes it uniform
+    PoseEstimate estimate = pf.GetPoseEstimate();
+    WeightSummary summary = pf.SummarizeWeights();
+    const Particle& bestParticle = pf.particles[summary.best_index];
+    const double best[3] = {bestParticle.x, bestParticle.y, bestParticle.theta};
+    auto t2r = std::chrono::steady_clock::now();
+    if (!cfg.auxiliary) {
+      pf.resample();
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    long long a3 = g_allocations;
+    long long m3 = cacheMisses.Read();
+    misses[0] += m1 - m0;
+    misses[1] += m2 - m1;
+    misses[2] += m3 - m2;
+    if ((int)t >= kWarmupFrames) {
+      allocs[0] += a1 - a0;
+      allocs[1] += a2 - a1;
+      allocs[2] += a3 - a2;
+    }
+
+    tPredict += Millis(t0, t1);
+    tUpdate += Millis(t1, t2);
+    tResample += Millis(t2r, t3);
+    if (t == 0) {
+      tFirstUpdate = Millis(t1, t2);
+    }
+    hitRate += pf.AssociationCacheHitRate();
+    sumReached += pf.GetDeadlineStats().reached;
+    sumShed += pf.GetDeadlineStats().shed;
+    if ((int)t >= kWarmupFrames) {
+      sumStepMs += pf.GetDeadlineStats().step_ms;
+      maxStepMs = std::max(maxStepMs, pf.GetDeadlineStats().step_ms);
+    }
+    sumSolves += pf.GetAssociationStats().assignment_solves;
+    sumSolverMs += pf.GetAssociationStats().assignment_ms;
+    sumPruned += pf.GetAssociationStats().pruned;
+    sumSkipped += pf.GetAssociationStats().coarse_skipped;
+    maxParticles = std::max(maxParticles, (size_t)pf.NumParticles());
+    sumParticles += pf.NumParticles();
+    sumStored += pf.particles.size();
+
+    double* err = getError(f.gt.x, f.gt.y, f.gt.theta, best[0], best[1], best[2]);
+    for (int k=0; k<3; k++) {
+      errBest[k] += err[k];
+    }
+    if (convergedFrame < 0 && err[0] < 1.0 && err[1] < 1.0) {
+      convergedFrame = (int)t;
+    }
+    if (cfg.kidnap_frame >= 0 && (int)t >= cfg.kidnap_frame && recoveredFrame < 0 &&
+        err[0] < 1.0 && err[1] < 1.0) {
+      recoveredFrame = (int)t;
+    }
+    injected += pf.GetAugmentedMclStats().injected;
+    err = getError(f.gt.x, f.gt.y, f.gt.theta, estimate.x, estimate.y, estimate.theta);
+    for (int k=0; k<3; k++) {
+      errMean[k] += err[k];
+    }
+  }
+
+  double n = (double)frames.size();
+  printf("frames             %d\n", (int)frames.size());
+  printf("threads            %d\n", cfg.threads);
+  printf("particles max/avg/end %d / %.0f / %d\n", (int)maxParticles,
+         sumParticles / frames.size(), pf.NumParticles());
+  if (cfg.multiplicity) {
+    printf("stored after resample avg %.0f\n", sumStored / n);
+  }
+  if (cfg.global_particles > 0) {
+    printf("converged at frame %d\n", convergedFrame);
+  }
+  if (cfg.kidnap_frame >= 0) {
+    printf("kidnapped at frame %d, recovered after %d frames\n", cfg.kidnap_frame,
+           recoveredFrame < 0 ? -1 : recoveredFrame - cfg.kidnap_frame);
+  }
+  if (cfg.augmented_mcl) {
+    printf("injected particles %d\n", injected);
+  }
+  printf("error best x/y/yaw %.3f %.3f %.4f\n", errBest[0] / n, errBest[1] / n, errBest[2] / n);
+  printf("error mean x/y/yaw %.3f %.3f %.4f\n", errMean[0] / n, errMean[1] / n, errMean[2] / n);
+  printf("assoc cache hits   %.3f\n", hitRate / n);
+  if (cfg.assignment) {
+    printf("assignment solves/ms per step %.1f / %.4f\n", sumSolves / n, sumSolverMs / n);
+  }
+  if (cfg.prune_margin > 0.0) {
+    printf("pruned per step    %.1f of %.0f\n", sumPruned / n, sumParticles / n);
+  }
+  if (cfg.two_stage > 0.0) {
+    printf("exact per step     %.1f of %.0f\n", (sumParticles - sumSkipped) / n, sumParticles / n);
+  }
+  if (cfg.field_res > 0.0) {
+    CompareLikelihoodField(pf.GetLikelihoodField(), map, frames);
+    // The field is built in the first update
+    printf("ms first update    %.4f, later %.4f\n", tFirstUpdate,
+           (tUpdate - tFirstUpdate) / std::max(1.0, n - 1));
+  }
+  if (cfg.hybrid) {
+    const HybridStats& hs = pf.GetHybridStats();
+    printf("pf steps/ms        %d / %.4f per step\n", hs.pf_steps,
+           hs.pf_steps > 0 ? hs.pf_ms / hs.pf_steps : 0.0);
+    printf("ekf steps/ms       %d / %.4f per step\n", hs.ekf_steps,
+           hs.ekf_steps > 0 ? hs.ekf_ms / hs.ekf_steps : 0.0);
+    printf("collapses/expansions %d / %d\n", hs.collapses, hs.expansions);
+  }
+  if (cfg.deadline_ms > 0.0) {
+    printf("reached/shed avg   %.0f / %.0f\n", sumReached / n, sumShed / n);
+    printf("ms/step avg/max    %.4f / %.4f\n", sumStepMs / std::max(1.0, n - kWarmupFrames), maxStepMs);
+  }
+  double steady = std::max(1.0, n - kWarmupFrames);
+  printf("allocs/frame predict/update/resample %.2f / %.2f / %.2f\n",
+         allocs[0] / steady, allocs[1] / steady, allocs[2] / steady);
+  if (cacheMisses.Available()) {
+    printf("cache misses/frame predict/update/resample %.0f / %.0f / %.0f\n",
+           misses[0] / n, misses[1] / n, misses[2] / n);
+  } else {
+    printf("cache misses/frame n/a\n");
+  }
+  printf("ms/frame predict   %.4f\n", tPredict / n);
+  printf("ms/frame update    %.4f\n", tUpdate / n);
+  printf("ms/frame resample  %.4f\n", tResample / n);
+  printf("ms/frame total     %.4f\n", (tPredict + tUpdate + tResample) / n);
+  return 0;
+}
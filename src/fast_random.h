@@ -0,0 +1,216 @@
+/**
+ * fast_random.h
+ * Counter based random numbers and batched normal samples.
+ *
+ * Element i of a stream is a pure function of (key, i): a SplitMix64 hash
+ * of the counter. There is no serial state to carry from one sample to the
+ * next, so filling an array is a loop without dependencies that the
+ * compiler can vectorize, and any part of a stream can be regenerated.
+ *
+ * Normal samples use Box-Muller with branch free polynomial log and
+ * sin/cos. The angle is drawn on a quarter circle and the quadrant from
+ * two random sign bits, which gives the same distribution as a full circle.
+ * Samples are accurate to about 1e-10.
+ *
+ * CumulativeSampler draws weighted indices for resampling.
+ */
+
+#ifndef FAST_RANDOM_H_
+#define FAST_RANDOM_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <random>
+
+class CounterRng {
+ public:
+  explicit CounterRng(uint64_t seed = 0) : key(Hash(seed)), counter(0) {}
+
+  /**
+   * SplitMix64 finalizer, a bijective 64 bit hash.
+   */
+  static uint64_t Hash(uint64_t z) {
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
+  /**
+   * Next 64 random bits.
+   */
+  uint64_t Next() {
+    return Hash(key + counter++);
+  }
+
+  /**
+   * Uniform sample in (0, 1].
+   */
+  double Uniform() {
+    return ToUnit(Next());
+  }
+
+  /**
+   * Fill out[0 .. n-1] with samples of N(mean, stddev^2).
+   */
+  template <class T>
+  void FillNormal(T* out, int n, double mean, double stddev) {
+    const int kBatch = 64;  // pairs per batch, sized for the stack buffers
+    double z[2 * kBatch];
+    for (int done=0; done<n; done+=2*kBatch)
+    {
+      const int pairs = std::min(kBatch, (n - done + 1) / 2);
+      const uint64_t base = counter;
+      for (int i=0; i<pairs; i++)
+      {
+        uint64_t a = Hash(key + base + 2 * i);
+        uint64_t b = Hash(key + base + 2 * i + 1);
+
+        // Radius from a, angle in [0, pi/2) and two sign bits from b
+        double r = sqrt(-2.0 * Log(ToUnit(a)));
+        double t = (UnitBits(b) - 1.0) * (M_PI / 2.0) - M_PI / 4.0;
+        double c, s;
+        SinCosQuarter(t, s, c);
+        z[2 * i] = FlipSign(r * c, b & 1);
+        z[2 * i + 1] = FlipSign(r * s, (b >> 1) & 1);
+      }
+      counter += 2 * pairs;
+
+      const int count = std::min(2 * pairs, n - done);
+      for (int i=0; i<count; i++)
+      {
+        out[done + i] = (T)(mean + stddev * z[i]);
+      }
+    }
+  }
+
+ private:
+  // Uniform in (0, 1] from the top 52 bits
+  static double ToUnit(uint64_t bits) {
+    return 2.0 - UnitBits(bits);
+  }
+
+  // Uniform in [1, 2) from the top 52 bits, built directly as a double
+  //   (integer to double conversion does not vectorize on SSE2/AVX2)
+  static double UnitBits(uint64_t bits) {
+    return FromBits((bits >> 12) | 0x3FF0000000000000ull);
+  }
+
+  static double FromBits(uint64_t bits) {
+    double v;
+    memcpy(&v, &bits, sizeof(v));
+    return v;
+  }
+
+  static uint64_t ToBits(double v) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return bits;
+  }
+
+  static double FlipSign(double v, uint64_t flip) {
+    return FromBits(ToBits(v) ^ (flip << 63));
+  }
+
+  /**
+   * Natural logarithm of a positive, normal x. The mantissa is brought to
+   *   [sqrt(1/2), sqrt(2)) and log(m) = 2 atanh((m - 1) / (m + 1)).
+   */
+  static double Log(double x) {
+    uint64_t bits = ToBits(x);
+    int64_t e = (int64_t)((bits >> 52) & 0x7FF) - 1023;
+    double m = FromBits((bits & 0x000FFFFFFFFFFFFFull) | 0x3FF0000000000000ull);
+    bool high = m > M_SQRT2;
+    m = high ? 0.5 * m : m;
+    e = high ? e + 1 : e;
+
+    double s = (m - 1.0) / (m + 1.0);
+    double s2 = s * s;
+    double p = 1.0 / 13.0;
+    p = p * s2 + 1.0 / 11.0;
+    p = p * s2 + 1.0 / 9.0;
+    p = p * s2 + 1.0 / 7.0;
+    p = p * s2 + 1.0 / 5.0;
+    p = p * s2 + 1.0 / 3.0;
+    p = p * s2 + 1.0;
+    return (double)e * M_LN2 + 2.0 * s * p;
+  }
+
+  /**
+   * sin and cos of t + pi/4 for t in [-pi/4, pi/4), by Taylor series of
+   *   sin(t) and cos(t) and the angle addition with pi/4.
+   */
+  static void SinCosQuarter(double t, double& s, double& c) {
+    double t2 = t * t;
+    double sp = -1.0 / 39916800.0;
+    sp = sp * t2 + 1.0 / 362880.0;
+    sp = sp * t2 - 1.0 / 5040.0;
+    sp = sp * t2 + 1.0 / 120.0;
+    sp = sp * t2 - 1.0 / 6.0;
+    sp = sp * t2 + 1.0;
+    double st = t * sp;
+
+    double cp = 1.0 / 479001600.0;
+    cp = cp * t2 - 1.0 / 3628800.0;
+    cp = cp * t2 + 1.0 / 40320.0;
+    cp = cp * t2 - 1.0 / 720.0;
+    cp = cp * t2 + 1.0 / 24.0;
+    cp = cp * t2 - 1.0 / 2.0;
+    cp = cp * t2 + 1.0;
+    double ct = cp;
+
+    s = (st + ct) * M_SQRT1_2;
+    c = (ct - st) * M_SQRT1_2;
+  }
+
+  uint64_t key;
+  uint64_t counter;
+};
+
+/**
+ * Draws indices with probability proportional to their weights by inverting
+ *   the cumulative sum, as std::discrete_distribution does, but with the
+ *   table in a vector of the caller (e.g. in a frame arena). Draws are
+ *   uniform when the weights do not sum to a positive value.
+ */
+template <class Table>
+class CumulativeSampler {
+ public:
+  /**
+   * Build the table over weight(0) .. weight(n-1).
+   */
+  template <class Weight>
+  CumulativeSampler(Table& table, int n, Weight weight) : cumulative(table) {
+    cumulative.clear();
+    cumulative.reserve(n);
+    double total = 0.0;
+    for (int i=0; i<n; i++)
+    {
+      total += weight(i);
+      cumulative.push_back(total);
+    }
+    if (!(total > 0.0))
+    {
+      for (int i=0; i<n; i++)
+      {
+        cumulative[i] = i + 1.0;
+      }
+      total = n;
+    }
+    pick = std::uniform_real_distribution<double>(0.0, total);
+  }
+
+  template <class Gen>
+  int operator()(Gen& gen) {
+    int i = (int)(std::upper_bound(cumulative.begin(), cumulative.end(), pick(gen)) - cumulative.begin());
+    return std::min(i, (int)cumulative.size() - 1);
+  }
+
+ private:
+  Table& cumulative;
+  std::uniform_real_distribution<double> pick;
+};
+
+#endif  // FAST_RANDOM_H_
@@ -0,0 +1,207 @@
+/**
+ * fleet_engine.cpp
+ */
+
+#include "fleet_engine.h"
+
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include "motion_model.h"
+#include "parallel.h"
+
+using std::vector;
+
+// Particles per block of the batch loops
+static const int kFleetBlock = 1024;
+
+
+void FleetEngine::Step(vector<FleetSession>& sessions, double delta_t, double std_pos[],
+                       double sensor_range, double std_landmark[], const Map& map_landmarks) {
+  // (Re)build the shared likelihood field if the map or model changed
+  if (!landmark_index.IsBuiltFrom(map_landmarks))
+  {
+    landmark_index.Build(map_landmarks, sensor_range, 1);
+    field_stale = true;
+  }
+  if (field_stale || !field.IsBuiltFor(std_landmark))
+  {
+    field.Build(landmark_index, std_landmark, sensor_range, field_resolution, field_max_bytes);
+    field_stale = false;
+  }
+
+  // Sessions whose own step the batch would not reproduce take it instead
+  batch.clear();
+  batch_observations.clear();
+  for (auto& session : sessions)
+  {
+    const vector<LandmarkObs>* observations =
+      session.filter->BeginExternalStep(*session.observations, field_resolution, field_max_bytes);
+    if (observations)
+    {
+      batch.push_back(&session);
+      batch_observations.push_back(observations);
+    }
+    else
+    {
+      session.filter->prediction(delta_t, std_pos, session.velocity, session.yaw_rate);
+      session.filter->updateWeights(sensor_range, std_landmark, *session.observations, map_landmarks);
+    }
+  }
+  const std::chrono::steady_clock::time_point batchStart = std::chrono::steady_clock::now();
+  Gather();
+
+  const int total = batched_particles;
+  noise_x.resize(total);
+  noise_y.resize(total);
+  noise_theta.resize(total);
+  noise_rng.FillNormal(noise_x.data(), total, 0.0, std_pos[0]);
+  noise_rng.FillNormal(noise_y.data(), total, 0.0, std_pos[1]);
+  noise_rng.FillNormal(noise_theta.data(), total, 0.0, std_pos[2]);
+
+  // One sweep over all particles. A block runs the sessions it overlaps,
+  //   each over its particles in the block with the session constants
+  //   hoisted out of the loops.
+  ParallelFor(total, kFleetBlock, workers, [&](int block, int begin, int end) {
+    int s = (int)(std::upper_bound(session_start.begin(), session_start.end(), begin) -
+                  session_start.begin()) - 1;
+    for (; s<batched_sessions && session_start[s]<end; s++)
+    {
+      const int first = std::max(begin, session_start[s]);
+      const int last = std::min(end, session_start[s + 1]);
+      const CtrvModel<double> motion(delta_t, batch[s]->velocity, batch[s]->yaw_rate);
+      const double dTheta = motion.DeltaTheta();
+      double* px = x.data();
+      double* py = y.data();
+      double* pTheta = theta.data();
+      double* pCos = cos_theta.data();
+      double* pSin = sin_theta.data();
+      const double* pNoiseX = noise_x.data();
+      const double* pNoiseY = noise_y.data();
+      const double* pNoiseTheta = noise_theta.data();
+
+      // CTRV motion. Position and heading are separate loops, each
+      //   writing few enough arrays for the compiler's aliasing checks.
+      for (int n=first; n<last; n++)
+      {
+        double c1, s1;
+        motion.Move(px[n], py[n], pCos[n], pSin[n], c1, s1);
+        px[n] += pNoiseX[n];
+        py[n] += pNoiseY[n];
+      }
+      // Heading, with the noise rotation of the cached sin and cos by their
+      //   series (see ParticleFilter::prediction())
+      for (int n=first; n<last; n++)
+      {
+        double c1, s1;
+        motion.Turn(pCos[n], pSin[n], c1, s1);
+        RotateHeadingSeries(pNoiseTheta[n], c1, s1);
+        pTheta[n] += dTheta + pNoiseTheta[n];
+        pCos[n] = c1;
+        pSin[n] = s1;
+      }
+      // Noise beyond the range of the series, rare for small std_pos[2]
+      for (int n=first; n<last; n++)
+      {
+        if (fabs(noise_theta[n]) >= kHeadingSeriesRange)
+        {
+          cos_theta[n] = cos(theta[n]);
+          sin_theta[n] = sin(theta[n]);
+        }
+      }
+
+      // Likelihood field weighting, one observation at a time over all
+      //   particles of the session
+      std::fill(log_weight.begin() + first, log_weight.begin() + last, 0.0);
+      for (int m=obs_start[s]; m<obs_start[s + 1]; m++)
+      {
+        field.AccumulateLogLikelihood(&x[first], &y[first], &cos_theta[first], &sin_theta[first],
+                                      last - first, obs_x[m], obs_y[m], &log_weight[first]);
+      }
+    }
+  });
+
+  Scatter(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batchStart).count());
+}
+
+void FleetEngine::Resample(vector<FleetSession>& sessions) {
+  ParallelFor((int)sessions.size(), 1, workers, [&](int block, int begin, int end) {
+    for (int s=begin; s<end; s++)
+    {
+      sessions[s].filter->resample();
+    }
+  });
+}
+
+void FleetEngine::Gather() {
+  session_start.assign(1, 0);
+  obs_start.assign(1, 0);
+  obs_x.clear();
+  obs_y.clear();
+  for (size_t s=0; s<batch.size(); s++)
+  {
+    session_start.push_back(session_start.back() + (int)batch[s]->filter->particles.size());
+
+    // The observations the filter selected, also passed to it in Scatter()
+    const vector<LandmarkObs>& obs = *batch_observations[s];
+    for (size_t m=0; m<obs.size(); m++)
+    {
+      obs_x.push_back(obs[m].x);
+      obs_y.push_back(obs[m].y);
+    }
+    obs_start.push_back((int)obs_x.size());
+  }
+  batched_sessions = (int)batch.size();
+  batched_particles = session_start.back();
+
+  const int total = batched_particles;
+  x.resize(total);
+  y.resize(total);
+  theta.resize(total);
+  cos_theta.resize(total);
+  sin_theta.resize(total);
+  log_weight.resize(total);
+  ParallelFor(batched_sessions, 1, workers, [&](int block, int begin, int end) {
+    for (int s=begin; s<end; s++)
+    {
+      const vector<Particle>& particles = batch[s]->filter->particles;
+      int n = session_start[s];
+      for (const Particle& p : particles)
+      {
+        x[n] = p.x;
+        y[n] = p.y;
+        theta[n] = p.theta;
+        cos_theta[n] = p.cos_theta;
+        sin_theta[n] = p.sin_theta;
+        n++;
+      }
+    }
+  });
+}
+
+void FleetEngine::Scatter(double batch_ms) {
+  ParallelFor(batched_sessions, 1, workers, [&](int block, int begin, int end) {
+    for (int s=begin; s<end; s++)
+    {
+      vector<Particle>& particles = batch[s]->filter->particles;
+      int n = session_start[s];
+      for (Particle& p : particles)
+      {
+        p.x = x[n];
+        p.y = y[n];
+        p.theta = theta[n];
+        p.cos_theta = cos_theta[n];
+        p.sin_theta = sin_theta[n];
+        p.log_weight = log_weight[n];
+        p.weight = exp(log_weight[n]);
+        p.associations.clear();
+        p.sense_x.clear();
+        p.sense_y.clear();
+        n++;
+      }
+      const double share = batched_particles > 0 ?
+        (double)(session_start[s + 1] - session_start[s]) / batched_particles : 0.0;
+      batch[s]->filter->FinishExternalUpdate(*batch_observations[s], batch_ms * share);
+    }
+  });
+}
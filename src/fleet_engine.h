@@ -0,0 +1,142 @@
+/**
+ * fleet_engine.h
+ * Batched prediction and weighting of many particle filters on one map.
+ *
+ * A filter serving one vehicle has too few particles for its loops to use
+ * the vector units and worker threads well. The fleet engine gathers the
+ * particles of all sessions into one structure of arrays, runs the motion
+ * model and the likelihood field weighting over the whole batch, each
+ * particle with the controls and observations of its own session, and
+ * scatters the results back. Inner loops run over the contiguous particles
+ * of one session with the session's constants hoisted, so they vectorize.
+ *
+ * Weighting uses a likelihood field (see likelihood_field.h) shared by all
+ * sessions. A session is batched only if the batch computes what its own
+ * step would: its filter weights by a likelihood field with the engine's
+ * spacing and memory bound, and each session is weighted with the
+ * observations its filter's observation limit keeps. Other sessions, e.g.
+ * with nearest neighbour weighting, in EKF mode or under a step deadline,
+ * take their regular per filter step (see
+ * ParticleFilter::BeginExternalStep()).
+ */
+
+#ifndef FLEET_ENGINE_H_
+#define FLEET_ENGINE_H_
+
+#include <stddef.h>
+#include <vector>
+#include "fast_random.h"
+#include "landmark_index.h"
+#include "likelihood_field.h"
+#include "parallel.h"
+#include "particle_filter.h"
+
+// One session of a fleet step
+struct FleetSession {
+  ParticleFilter* filter;
+  double velocity;   // Control of the step [m/s]
+  double yaw_rate;   // Control of the step [rad/s]
+  const std::vector<LandmarkObs>* observations;
+};
+
+class FleetEngine {
+ public:
+  FleetEngine() : num_threads(1), field_resolution(0.1),
+                  field_max_bytes(64 * 1024 * 1024), field_stale(true), batched_sessions(0),
+                  batched_particles(0) {}
+
+  /**
+   * Set the number of worker threads of the batch.
+   */
+  void SetNumThreads(int threads) {
+    num_threads = threads > 0 ? threads : 1;
+    workers.Resize(num_threads);
+  }
+
+  /**
+   * Set the spacing and memory bound of the shared likelihood field. Only
+   *   filters with the same ParticleFilter::SetLikelihoodField() settings
+   *   are batched.
+   */
+  void SetLikelihoodField(double resolution, size_t max_bytes) {
+    field_resolution = resolution;
+    field_max_bytes = max_bytes;
+    field_stale = true;
+  }
+
+  /**
+   * Predict and weight every session, replacing prediction() and
+   *   updateWeights() of its filter. Every filter must be initialized and
+   *   all use 'map_landmarks'. The particles are left weighted, ready for
+   *   resample(). The associations and sense coordinates of batched
+   *   particles are cleared.
+   * @param delta_t, std_pos[] As for ParticleFilter::prediction()
+   * @param sensor_range, std_landmark[] As for ParticleFilter::updateWeights()
+   */
+  void Step(std::vector<FleetSession>& sessions, double delta_t, double std_pos[],
+            double sensor_range, double std_landmark[], const Map& map_landmarks);
+
+  /**
+   * Resample every session, the sessions spread over the worker threads.
+   */
+  void Resample(std::vector<FleetSession>& sessions);
+
+  /**
+   * The shared likelihood field, valid after the first Step().
+   */
+  const LikelihoodField& GetLikelihoodField() const {
+    return field;
+  }
+
+  /**
+   * Sessions and particles of the last batch.
+   */
+  int BatchedSessions() const { return batched_sessions; }
+  int BatchedParticles() const { return batched_particles; }
+
+ private:
+  // Gather the sessions in 'batch' into the arrays below
+  void Gather();
+
+  // Scatter the poses and weights back to the filters. Each is charged
+  //   its share by particles of the batch time 'batch_ms'.
+  void Scatter(double batch_ms);
+
+  int num_threads;
+  WorkerPool workers;
+
+  // Shared likelihood field
+  double field_resolution;
+  size_t field_max_bytes;
+  bool field_stale;
+  LandmarkIndex landmark_index;
+  LikelihoodField field;
+
+  CounterRng noise_rng;
+
+  // Batched sessions; the particles of session s are
+  //   [session_start[s], session_start[s+1]) and its observations, those
+  //   its filter selected, [obs_start[s], obs_start[s+1])
+  std::vector<FleetSession*> batch;
+  std::vector<const std::vector<LandmarkObs>*> batch_observations;
+  std::vector<int> session_start;
+  std::vector<int> obs_start;
+  std::vector<double> obs_x;
+  std::vector<double> obs_y;
+
+  // Particles of all batched sessions, structure of arrays
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> theta;
+  std::vector<double> cos_theta;
+  std::vector<double> sin_theta;
+  std::vector<double> log_weight;
+  std::vector<double> noise_x;
+  std::vector<double> noise_y;
+  std::vector<double> noise_theta;
+
+  int batched_sessions;
+  int batched_particles;
+};
+
+#endif  // FLEET_ENGINE_H_
@@ -0,0 +1,130 @@
+/**
+ * frame_arena.h
+ * Bump allocator for temporaries that live for one filter step.
+ *
+ * Allocation advances a pointer in the current block; memory is released
+ * all at once by Reset() when a step starts. If a step needs more than
+ * the block holds, extra blocks are chained and Reset() replaces them by
+ * one block of the combined size, so after the first few steps a frame
+ * allocates nothing from the heap.
+ */
+
+#ifndef FRAME_ARENA_H_
+#define FRAME_ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <new>
+#include <vector>
+
+class FrameArena {
+ public:
+  explicit FrameArena(size_t initial_size = 64 * 1024)
+    : head(NULL), head_size(0), offset(0), used_total(0), high_water(0) {
+    Grow(initial_size);
+  }
+
+  ~FrameArena() {
+    Release();
+  }
+
+  /**
+   * Allocate 'bytes' aligned to 'align' (a power of two).
+   */
+  void* Allocate(size_t bytes, size_t align) {
+    size_t start = (offset + align - 1) & ~(align - 1);
+    if (start + bytes > head_size)
+    {
+      Grow(std::max(2 * head_size, bytes + align));
+      start = (offset + align - 1) & ~(align - 1);
+    }
+    offset = start + bytes;
+    high_water = std::max(high_water, used_total + offset);
+    return head + start;
+  }
+
+  /**
+   * Release everything allocated since the last reset. O(1) unless the
+   *   arena overflowed into extra blocks during the step.
+   */
+  void Reset() {
+    if (!chained.empty())
+    {
+      size_t total = high_water;
+      Release();
+      Grow(total);
+    }
+    offset = 0;
+    used_total = 0;
+  }
+
+  /**
+   * Highest number of bytes in use at once since construction.
+   */
+  size_t HighWater() const { return high_water; }
+
+ private:
+  FrameArena(const FrameArena&);
+  FrameArena& operator=(const FrameArena&);
+
+  void Grow(size_t size) {
+    if (head)
+    {
+      chained.push_back(head);
+      used_total += offset;
+    }
+    head = static_cast<char*>(::operator new(size));
+    head_size = size;
+    offset = 0;
+  }
+
+  void Release() {
+    for (char* block : chained)
+    {
+      ::operator delete(block);
+    }
+    chained.clear();
+    ::operator delete(head);
+    head = NULL;
+  }
+
+  char* head;                  // Current block
+  size_t head_size;
+  size_t offset;               // First free byte in the current block
+  size_t used_total;           // Bytes used in the chained blocks
+  size_t high_water;
+  std::vector<char*> chained;  // Full blocks of this step
+};
+
+/**
+ * STL allocator drawing from a FrameArena. deallocate() is a no-op, the
+ *   memory comes back with FrameArena::Reset().
+ */
+template <class T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(FrameArena& arena) : arena(&arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(arena->Allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T*, size_t) {}
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+  FrameArena* arena;
+};
+
+// Vector of per step temporaries
+template <class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+#endif  // FRAME_ARENA_H_
@@ -99,6 +99,18 @@ inline double multiv_prob(double sig_x, double sig_y, double x_obs, double y_obs
   return weight;
 }
 
+/**
+ * Natural logarithm of multiv_prob(), without underflow for observations
+ *   far from the landmark.
+ */
+inline double log_multiv_prob(double sig_x, double sig_y, double x_obs, double y_obs,
+                              double mu_x, double mu_y) {
+  double dx = x_obs - mu_x;
+  double dy = y_obs - mu_y;
+  return -log(2 * M_PI * sig_x * sig_y)
+         - (dx * dx / (2 * sig_x * sig_x) + dy * dy / (2 * sig_y * sig_y));
+}
+
 /**
  * Reads map data from a file.
  * @param filename Name of file containing map data.
@@ -0,0 +1,122 @@
+/**
+ * inline_vector.h
+ * Vector with inline storage for its first N elements.
+ *
+ * Supports the subset of the std::vector interface used for per particle
+ * data. Up to N elements live inside the object, without heap allocation.
+ * A push_back() beyond N moves the contents to a heap buffer, which is kept
+ * through clear() and assignment, so a vector that spilled once reuses its
+ * buffer in later steps.
+ */
+
+#ifndef INLINE_VECTOR_H_
+#define INLINE_VECTOR_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+template <class T, int N>
+class InlineVector {
+ public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+
+  InlineVector() : count(0), data(items) {}
+
+  // Copies only the elements in use
+  InlineVector(const InlineVector& other) : count(0), data(items) {
+    assign(other.begin(), other.end());
+  }
+  InlineVector& operator=(const InlineVector& other) {
+    if (this != &other)
+    {
+      assign(other.begin(), other.end());
+    }
+    return *this;
+  }
+
+  /**
+   * Replace the contents by [first, last) of a forward iterator.
+   */
+  template <class It>
+  void assign(It first, It last) {
+    size_t n = (size_t)std::distance(first, last);
+    if (n <= (size_t)N)
+    {
+      heap.clear();
+      std::copy(first, last, items);
+      data = items;
+    }
+    else
+    {
+      Reserve(n);
+      heap.assign(first, last);
+      data = heap.data();
+    }
+    count = n;
+  }
+
+  /**
+   * Append 'v', spilling to the heap buffer beyond the inline capacity.
+   */
+  void push_back(const T& v) {
+    if (data == items)
+    {
+      if (count < N)
+      {
+        items[count++] = v;
+        return;
+      }
+      Reserve(2 * N);
+      heap.assign(items, items + N);
+    }
+    Reserve(count + 1);
+    heap.push_back(v);
+    data = heap.data();
+    count++;
+  }
+
+  void clear() {
+    count = 0;
+    heap.clear();
+    data = items;
+  }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  // Whether the elements are in the heap buffer
+  bool spilled() const { return data != items; }
+
+  T& operator[](size_t i) { return data[i]; }
+  const T& operator[](size_t i) const { return data[i]; }
+
+  iterator begin() { return data; }
+  iterator end() { return data + count; }
+  const_iterator begin() const { return data; }
+  const_iterator end() const { return data + count; }
+
+ private:
+  // Grow the heap buffer to a power of two times N, so buffers filled by
+  //   assign() and by push_back() settle on the same few sizes
+  void Reserve(size_t n) {
+    if (n > heap.capacity())
+    {
+      size_t cap = 2 * N;
+      while (cap < n)
+      {
+        cap *= 2;
+      }
+      heap.reserve(cap);
+    }
+  }
+
+  size_t count;
+  T* data;  // 'items' or the heap buffer
+  T items[N];
+  std::vector<T> heap;
+};
+
+#endif  // INLINE_VECTOR_H_
@@ -0,0 +1,164 @@
+/**
+ * landmark_index.cpp
+ */
+
+#include "landmark_index.h"
+
+#include <math.h>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+using std::vector;
+
+
+void LandmarkIndex::Build(const Map &map, double cellSize, int numNeighbours) {
+  source = &map;
+  source_size = map.landmark_list.size();
+  cell_size = cellSize;
+  inv_cell_size = 1.0 / cellSize;
+
+  const int numLandmarks = (int)map.landmark_list.size();
+  id.resize(numLandmarks);
+  x.resize(numLandmarks);
+  y.resize(numLandmarks);
+
+  int maxId = -1;
+  for (int n=0; n<numLandmarks; n++)
+  {
+    id[n] = map.landmark_list[n].id_i;
+    x[n] = map.landmark_list[n].x_f;
+    y[n] = map.landmark_list[n].y_f;
+    maxId = std::max(maxId, id[n]);
+  }
+
+  min_x = max_x = numLandmarks > 0 ? x[0] : 0.0;
+  min_y = max_y = numLandmarks > 0 ? y[0] : 0.0;
+  for (int n=1; n<numLandmarks; n++)
+  {
+    min_x = std::min(min_x, x[n]);
+    max_x = std::max(max_x, x[n]);
+    min_y = std::min(min_y, y[n]);
+    max_y = std::max(max_y, y[n]);
+  }
+
+  index_of_id.assign(maxId + 1, -1);
+  for (int n=0; n<numLandmarks; n++)
+  {
+    if (id[n] >= 0) {
+      index_of_id[id[n]] = n;
+    }
+  }
+
+  // Bucket landmarks into grid cells (counting sort into CSR layout)
+  grid.Reset(numLandmarks);
+  vector<int> slotOf(numLandmarks);
+  for (int n=0; n<numLandmarks; n++)
+  {
+    int cx = GridHash::CellCoord(x[n], inv_cell_size);
+    int cy = GridHash::CellCoord(y[n], inv_cell_size);
+    slotOf[n] = grid.Insert(GridHash::CellKey(cx, cy));
+  }
+  cell_start.assign(grid.size() + 1, 0);
+  for (int n=0; n<numLandmarks; n++)
+  {
+    cell_start[slotOf[n] + 1]++;
+  }
+  for (size_t s=0; s<grid.size(); s++)
+  {
+    cell_start[s + 1] += cell_start[s];
+  }
+  cell_members.resize(numLandmarks);
+  vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+  for (int n=0; n<numLandmarks; n++)
+  {
+    cell_members[fill[slotOf[n]]++] = n;
+  }
+
+  // K nearest neighbours of every landmark
+  num_neighbours = std::max(0, std::min(numNeighbours, numLandmarks - 1));
+  neighbours.assign(numLandmarks * num_neighbours, -1);
+  neighbour_count.assign(numLandmarks, 0);
+  nearest_dist.assign(numLandmarks, std::numeric_limits<double>::infinity());
+  neighbour_radius.assign(numLandmarks, std::numeric_limits<double>::infinity());
+
+  // Search the grid in square rings of cells around the landmark's cell.
+  //   A landmark outside ring r is at least r cells away, so the search
+  //   stops once the (K+1)-th nearest candidate is closer than that.
+  const int cx0 = GridHash::CellCoord(min_x, inv_cell_size);
+  const int cx1 = GridHash::CellCoord(max_x, inv_cell_size);
+  const int cy0 = GridHash::CellCoord(min_y, inv_cell_size);
+  const int cy1 = GridHash::CellCoord(max_y, inv_cell_size);
+  const int maxRing = std::max(cx1 - cx0, cy1 - cy0);
+  const int wanted = num_neighbours + 1;
+  vector<std::pair<double, int> > byDist;
+  for (int n=0; n<numLandmarks; n++)
+  {
+    byDist.clear();
+    const int cx = GridHash::CellCoord(x[n], inv_cell_size);
+    const int cy = GridHash::CellCoord(y[n], inv_cell_size);
+    for (int r=0; r<=maxRing; r++)
+    {
+      for (int dx=-r; dx<=r; dx++)
+      {
+        // Only the border of the ring: all of its rows at |dx| == r
+        const int step = (dx == -r || dx == r) ? 1 : 2 * r;
+        for (int dy=-r; dy<=r; dy+=std::max(step, 1))
+        {
+          int slot = grid.Find(GridHash::CellKey(cx + dx, cy + dy));
+          if (slot < 0) {
+            continue;
+          }
+          for (int k=cell_start[slot]; k<cell_start[slot + 1]; k++)
+          {
+            int m = cell_members[k];
+            if (m != n) {
+              byDist.push_back(std::make_pair(hypot(x[m] - x[n], y[m] - y[n]), m));
+            }
+          }
+        }
+      }
+      if ((int)byDist.size() >= wanted)
+      {
+        std::nth_element(byDist.begin(), byDist.begin() + (wanted - 1), byDist.end());
+        if (byDist[wanted - 1].first < r * cell_size) {
+          break;
+        }
+      }
+    }
+    const int kept = std::min((int)byDist.size(), wanted);
+    std::partial_sort(byDist.begin(), byDist.begin() + kept, byDist.end());
+
+    for (int k=0; k<num_neighbours; k++)
+    {
+      neighbours[n * num_neighbours + k] = byDist[k].second;
+    }
+    neighbour_count[n] = num_neighbours;
+    if (!byDist.empty()) {
+      nearest_dist[n] = byDist[0].first;
+    }
+    if (num_neighbours < (int)byDist.size()) {
+      neighbour_radius[n] = byDist[num_neighbours].first;
+    }
+  }
+}
+
+void LandmarkIndex::QueryRange(double qx, double qy, double range,
+                               vector<int>& result) const {
+  result.clear();
+  ForEachCell(qx, qy, range, [&](int begin, int end) {
+    for (int k=begin; k<end; k++)
+    {
+      int n = cell_members[k];
+      double dx = x[n] - qx;
+      double dy = y[n] - qy;
+      if (sqrt(dx * dx + dy * dy) < range) {
+        result.push_back(n);
+      }
+    }
+  });
+
+  // Keep map order so ties are resolved as in a linear scan over the map
+  std::sort(result.begin(), result.end());
+}
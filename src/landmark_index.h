@@ -0,0 +1,127 @@
+/**
+ * landmark_index.h
+ * Grid hashed spatial index over the map landmarks.
+ */
+
+#ifndef LANDMARK_INDEX_H_
+#define LANDMARK_INDEX_H_
+
+#include <vector>
+#include "map.h"
+#include "spatial_hash.h"
+
+class LandmarkIndex {
+ public:
+  LandmarkIndex() : min_x(0.0), max_x(0.0), min_y(0.0), max_y(0.0),
+                    source(NULL), source_size(0), cell_size(0.0),
+                    inv_cell_size(0.0), num_neighbours(0) {}
+
+  /**
+   * Build the index.
+   * @param map Map containing the landmarks
+   * @param cellSize Side length of a grid cell [m]
+   * @param numNeighbours Number of nearest neighbours stored per landmark
+   */
+  void Build(const Map &map, double cellSize, int numNeighbours);
+
+  /**
+   * Returns true if the index was built from 'map' in its current state.
+   */
+  bool IsBuiltFrom(const Map &map) const {
+    return source == &map && source_size == map.landmark_list.size();
+  }
+
+  /**
+   * Collect the indices of all landmarks closer than 'range' to (x, y),
+   *   in map order.
+   */
+  void QueryRange(double x, double y, double range, std::vector<int>& result) const;
+
+  /**
+   * Call visit(begin, end) for every occupied grid cell that overlaps the
+   *   square of half side 'range' around (x, y). The landmarks of a cell
+   *   are CellMembers()[begin .. end-1], so data stored in that order is
+   *   contiguous per cell.
+   */
+  template <class Visit>
+  void ForEachCell(double x, double y, double range, Visit visit) const {
+    int cx0 = GridHash::CellCoord(x - range, inv_cell_size);
+    int cx1 = GridHash::CellCoord(x + range, inv_cell_size);
+    int cy0 = GridHash::CellCoord(y - range, inv_cell_size);
+    int cy1 = GridHash::CellCoord(y + range, inv_cell_size);
+    for (int cx=cx0; cx<=cx1; cx++)
+    {
+      for (int cy=cy0; cy<=cy1; cy++)
+      {
+        int slot = grid.Find(GridHash::CellKey(cx, cy));
+        if (slot >= 0) {
+          visit(cell_start[slot], cell_start[slot + 1]);
+        }
+      }
+    }
+  }
+
+  /**
+   * Landmark indices ordered by grid cell, see ForEachCell().
+   */
+  const std::vector<int>& CellMembers() const { return cell_members; }
+
+  /**
+   * Index of the landmark with map id 'id', or -1.
+   */
+  int IndexOfId(int id) const {
+    if (id < 0 || id >= (int)index_of_id.size()) {
+      return -1;
+    }
+    return index_of_id[id];
+  }
+
+  /**
+   * Nearest neighbours of landmark 'idx', sorted by distance.
+   */
+  const int* Neighbours(int idx) const { return &neighbours[idx * num_neighbours]; }
+  int NumNeighbours(int idx) const { return neighbour_count[idx]; }
+
+  /**
+   * Distance from landmark 'idx' to its nearest other landmark.
+   */
+  double NearestNeighbourDist(int idx) const { return nearest_dist[idx]; }
+
+  /**
+   * Every landmark not in the neighbour list of 'idx' is at least this far
+   *   from 'idx'. Infinite if the list holds all other landmarks.
+   */
+  double NeighbourRadius(int idx) const { return neighbour_radius[idx]; }
+
+  size_t size() const { return id.size(); }
+
+  // Bounding box of all landmarks [m]
+  double min_x, max_x, min_y, max_y;
+
+  // Landmark data in map order
+  std::vector<int> id;
+  std::vector<double> x;
+  std::vector<double> y;
+
+ private:
+  const Map* source;
+  size_t source_size;
+
+  double cell_size;
+  double inv_cell_size;
+  GridHash grid;
+
+  // Landmarks of each grid slot: cell_members[cell_start[s] .. cell_start[s+1]-1]
+  std::vector<int> cell_start;
+  std::vector<int> cell_members;
+
+  std::vector<int> index_of_id;
+
+  int num_neighbours;
+  std::vector<int> neighbours;
+  std::vector<int> neighbour_count;
+  std::vector<double> nearest_dist;
+  std::vector<double> neighbour_radius;
+};
+
+#endif  // LANDMARK_INDEX_H_
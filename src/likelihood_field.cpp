@@ -0,0 +1,125 @@
+/**
+ * likelihood_field.cpp
+ */
+
+#include "likelihood_field.h"
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "helper_functions.h"
+
+using std::vector;
+
+
+void LikelihoodField::Build(const LandmarkIndex& index, const double std_landmark[],
+                            double margin, double res, size_t max_bytes) {
+  std_x = std_landmark[0];
+  std_y = std_landmark[1];
+
+  origin_x = index.min_x - margin;
+  origin_y = index.min_y - margin;
+  double width = index.max_x - index.min_x + 2.0 * margin;
+  double height = index.max_y - index.min_y + 2.0 * margin;
+
+  // Coarsen the spacing until the grid fits the memory bound
+  size_t maxNodes = std::max((size_t)4, max_bytes / sizeof(float));
+  double minRes = sqrt(width * height / maxNodes);
+  resolution = res;
+  while ((size_t)(ceil(width / resolution) + 1) * (size_t)(ceil(height / resolution) + 1) > maxNodes)
+  {
+    resolution = std::max(resolution * 1.1, minRes);
+  }
+  inv_resolution = 1.0 / resolution;
+  cols = (int)ceil(width / resolution) + 1;
+  rows = (int)ceil(height / resolution) + 1;
+
+  // Nearest landmark of every node, by tiles of nodes. The nearest landmark
+  //   of any node in a tile is no farther from the tile center than the
+  //   center's own nearest landmark plus the tile diagonal, so only the
+  //   landmarks within that radius are candidates.
+  field.assign((size_t)cols * rows, 0.0f);
+  const int kTile = 16;
+  const double tileDiag = kTile * resolution * M_SQRT2;
+  vector<int> found;
+  for (int r0=0; r0<rows; r0+=kTile)
+  {
+    for (int c0=0; c0<cols; c0+=kTile)
+    {
+      double cx = origin_x + (c0 + 0.5 * kTile) * resolution;
+      double cy = origin_y + (r0 + 0.5 * kTile) * resolution;
+
+      // Nearest landmark of the center; the radius grows until one is found
+      double radius = std::max(1.0, tileDiag);
+      found.clear();
+      while (index.size() > 0)
+      {
+        index.QueryRange(cx, cy, radius, found);
+        if (!found.empty())
+        {
+          break;
+        }
+        radius *= 2.0;
+      }
+      double centerDist = HUGE_VAL;
+      for (int idx : found)
+      {
+        centerDist = std::min(centerDist, dist(cx, cy, index.x[idx], index.y[idx]));
+      }
+      if (!found.empty())
+      {
+        index.QueryRange(cx, cy, centerDist + tileDiag + resolution, found);
+      }
+
+      int rowEnd = std::min(rows, r0 + kTile);
+      int colEnd = std::min(cols, c0 + kTile);
+      for (int r=r0; r<rowEnd; r++)
+      {
+        double y = origin_y + r * resolution;
+        for (int c=c0; c<colEnd; c++)
+        {
+          double x = origin_x + c * resolution;
+          double logLik = -HUGE_VAL;
+          double minDist = HUGE_VAL;
+          for (int idx : found)
+          {
+            double d = dist(x, y, index.x[idx], index.y[idx]);
+            if (d < minDist)
+            {
+              minDist = d;
+              logLik = log_multiv_prob(std_x, std_y, x, y, index.x[idx], index.y[idx]);
+            }
+          }
+          field[(size_t)r * cols + c] = (float)std::max(logLik, -1e30);
+        }
+      }
+    }
+  }
+}
+
+void LikelihoodField::AccumulateLogLikelihood(const double* x, const double* y,
+                                              const double* cos_theta, const double* sin_theta,
+                                              int n, double obs_x, double obs_y,
+                                              double* log_lik) const {
+  // As LogLikelihood(), with the node offset in 32 bits so the loads of
+  //   the nodes become gathers (the memory bound keeps the grid far below)
+  const float* nodes = field.data();
+  const double maxX = cols - 1.001;
+  const double maxY = rows - 1.001;
+  for (int i=0; i<n; i++)
+  {
+    double gx = (x[i] + cos_theta[i] * obs_x - sin_theta[i] * obs_y - origin_x) * inv_resolution;
+    double gy = (y[i] + sin_theta[i] * obs_x + cos_theta[i] * obs_y - origin_y) * inv_resolution;
+    gx = std::min(std::max(gx, 0.0), maxX);
+    gy = std::min(std::max(gy, 0.0), maxY);
+    int ix = (int)gx;
+    int iy = (int)gy;
+    double fx = gx - ix;
+    double fy = gy - iy;
+
+    int k = iy * cols + ix;
+    double top = nodes[k] + fx * (nodes[k + 1] - nodes[k]);
+    double bottom = nodes[k + cols] + fx * (nodes[k + cols + 1] - nodes[k + cols]);
+    log_lik[i] += top + fy * (bottom - top);
+  }
+}
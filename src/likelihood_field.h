@@ -0,0 +1,94 @@
+/**
+ * likelihood_field.h
+ * Precomputed observation log-likelihood over the map.
+ *
+ * Grid nodes store the log-likelihood of an observation at the node under
+ * the Gaussian landmark model, taken for the nearest landmark. Weighting a
+ * transformed observation is then a bilinear interpolation of four nodes,
+ * with no association search.
+ */
+
+#ifndef LIKELIHOOD_FIELD_H_
+#define LIKELIHOOD_FIELD_H_
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+#include "landmark_index.h"
+
+class LikelihoodField {
+ public:
+  LikelihoodField() : origin_x(0.0), origin_y(0.0), resolution(0.0),
+                      inv_resolution(0.0), cols(0), rows(0),
+                      std_x(0.0), std_y(0.0) {}
+
+  /**
+   * Build the field over the landmark bounding box grown by 'margin'.
+   * @param index Landmarks
+   * @param std_landmark[] Observation standard deviation in x and y [m]
+   * @param margin Border around the landmarks [m], e.g. the sensor range
+   * @param resolution Requested node spacing [m]
+   * @param max_bytes Memory bound; the spacing is coarsened to fit
+   */
+  void Build(const LandmarkIndex& index, const double std_landmark[], double margin,
+             double resolution, size_t max_bytes);
+
+  /**
+   * True if built for these observation standard deviations.
+   */
+  bool IsBuiltFor(const double std_landmark[]) const {
+    return !field.empty() && std_x == std_landmark[0] && std_y == std_landmark[1];
+  }
+
+  /**
+   * Interpolated log-likelihood of an observation at (x, y) in map
+   *   coordinates. Positions outside the grid use the nearest border value.
+   */
+  double LogLikelihood(double x, double y) const {
+    double gx = (x - origin_x) * inv_resolution;
+    double gy = (y - origin_y) * inv_resolution;
+    gx = std::min(std::max(gx, 0.0), cols - 1.001);
+    gy = std::min(std::max(gy, 0.0), rows - 1.001);
+    int ix = (int)gx;
+    int iy = (int)gy;
+    double fx = gx - ix;
+    double fy = gy - iy;
+
+    const float* p = &field[(size_t)iy * cols + ix];
+    double top = p[0] + fx * (p[1] - p[0]);
+    double bottom = p[cols] + fx * (p[cols + 1] - p[cols]);
+    return top + fy * (bottom - top);
+  }
+
+  /**
+   * Add the log-likelihood of one observation (obs_x, obs_y), seen from
+   *   each of n poses, to log_lik[0 .. n-1]. Same result as LogLikelihood()
+   *   of the transformed observation, in a loop that vectorizes.
+   * @param x, y, cos_theta, sin_theta Arrays of the n poses
+   */
+  void AccumulateLogLikelihood(const double* x, const double* y, const double* cos_theta,
+                               const double* sin_theta, int n, double obs_x, double obs_y,
+                               double* log_lik) const;
+
+  /**
+   * Node spacing actually used [m].
+   */
+  double Resolution() const { return resolution; }
+
+  size_t MemoryBytes() const { return field.size() * sizeof(float); }
+
+ private:
+  double origin_x;
+  double origin_y;
+  double resolution;
+  double inv_resolution;
+  int cols;
+  int rows;
+  double std_x;
+  double std_y;
+
+  // Row major log-likelihood of the nodes
+  std::vector<float> field;
+};
+
+#endif  // LIKELIHOOD_FIELD_H_
@@ -3,6 +3,7 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <thread>
 #include "json.hpp"
 #include "particle_filter.h"
 
@@ -38,6 +39,17 @@ int main() {
   // Landmark measurement uncertainty [x [m], y [m]]
   double sigma_landmark [2] = {0.3, 0.3};
 
+  // Add the weighted mean pose and its covariance to the reply
+  bool report_pose_estimate = true;
+  // Number of particle cloud modes added to the reply (0 disables)
+  int num_reported_modes = 3;
+
+  // Localize without the GPS fix, starting from particles spread over the
+  //   whole map. Also used when the simulator sends no position fix.
+  bool global_localization = false;
+  int global_particles = 20000;
+  int converged_particles = 100;
+
   // Read map data
   Map map;
   if (!read_map_data("../data/map_data.txt", map)) {
@@ -51,8 +63,17 @@ int main() {
   
   // Create particle filter
   ParticleFilter pf;
+  pf.SetNumThreads(std::thread::hardware_concurrency());
+
+  // Parsing temporaries of one message, and the observations reused
+  //   between messages
+  FrameArena message_arena;
+  vector<LandmarkObs> noisy_observations;
 
-  h.onMessage([&debugfile, &pf,&map,&delta_t,&sensor_range,&sigma_pos,&sigma_landmark]
+  h.onMessage([&debugfile, &pf,&map,&delta_t,&sensor_range,&sigma_pos,&sigma_landmark,
+               &report_pose_estimate,&num_reported_modes,&global_localization,
+               &global_particles,&converged_particles,&message_arena,
+               &noisy_observations]
               (uWS::WebSocket<uWS::SERVER> ws, char *data, size_t length, 
                uWS::OpCode opCode) {
     // "42" at the start of the message means there's a websocket message event.
@@ -68,14 +89,23 @@ int main() {
         string event = j[0].get<string>();
         
         if (event == "telemetry") {
+          // Release the parsing temporaries of the previous message here
+          //   rather than at the end, so a message whose handling threw
+          //   does not keep them
+          message_arena.Reset();
+
           // j[1] is the data JSON object
           if (!pf.initialized()) {
-            // Sense noisy position data from the simulator
-            double sense_x = std::stod(j[1]["sense_x"].get<string>());
-            double sense_y = std::stod(j[1]["sense_y"].get<string>());
-            double sense_theta = std::stod(j[1]["sense_theta"].get<string>());
-
-            pf.init(sense_x, sense_y, sense_theta, sigma_pos);
+            if (global_localization || j[1].find("sense_x") == j[1].end()) {
+              pf.InitGlobal(map, sensor_range, global_particles, converged_particles, true);
+            } else {
+              // Sense noisy position data from the simulator
+              double sense_x = std::stod(j[1]["sense_x"].get<string>());
+              double sense_y = std::stod(j[1]["sense_y"].get<string>());
+              double sense_theta = std::stod(j[1]["sense_theta"].get<string>());
+
+              pf.init(sense_x, sense_y, sense_theta, sigma_pos);
+            }
 
             debugfile << "Init PF:\n";
             pf.PrintAllParticlesData(debugfile);
@@ -93,18 +123,19 @@ int main() {
           // receive noisy observation data from the simulator
           // sense_observations in JSON format 
           //   [{obs_x,obs_y},{obs_x,obs_y},...{obs_x,obs_y}] 
-          vector<LandmarkObs> noisy_observations;
+          noisy_observations.clear();
           string sense_observations_x = j[1]["sense_observations_x"];
           string sense_observations_y = j[1]["sense_observations_y"];
 
-          vector<float> x_sense;
+          ArenaAllocator<float> alloc(message_arena);
+          ArenaVector<float> x_sense(alloc);
           std::istringstream iss_x(sense_observations_x);
 
           std::copy(std::istream_iterator<float>(iss_x),
           std::istream_iterator<float>(),
           std::back_inserter(x_sense));
 
-          vector<float> y_sense;
+          ArenaVector<float> y_sense(alloc);
           std::istringstream iss_y(sense_observations_y);
 
           std::copy(std::istream_iterator<float>(iss_y),
@@ -118,35 +149,52 @@ int main() {
             noisy_observations.push_back(obs);
           }
 
-          // Update the weights and resample
+          // Update the weights
           pf.updateWeights(sensor_range, sigma_landmark, noisy_observations, map);
-          pf.resample();
-          pf.PrintAllParticlesData(debugfile);
 
           // Calculate and output the average weighted error of the particle 
           //   filter over all time steps so far.
-          vector<Particle> particles = pf.particles;
-          int num_particles = particles.size();
-          double highest_weight = -1.0;
-          Particle best_particle;
-          double weight_sum = 0.0;
-          for (int i = 0; i < num_particles; ++i) {
-            if (particles[i].weight > highest_weight) {
-              highest_weight = particles[i].weight;
-              best_particle = particles[i];
-            }
-
-            weight_sum += particles[i].weight;
-          }
+          int num_particles = pf.NumParticles();
+          WeightSummary summary = pf.SummarizeWeights();
+          Particle best_particle = pf.particles[summary.best_index];
 
-          std::cout << "highest w " << highest_weight << std::endl;
-          std::cout << "average w " << weight_sum/num_particles << std::endl;
+          std::cout << "highest w " << summary.max_weight << std::endl;
+          std::cout << "average w " << summary.weight_sum/num_particles << std::endl;
+          std::cout << "assoc cache hit rate " << pf.AssociationCacheHitRate() << std::endl;
 
           json msgJson;
           msgJson["best_particle_x"] = best_particle.x;
           msgJson["best_particle_y"] = best_particle.y;
           msgJson["best_particle_theta"] = best_particle.theta;
 
+          // Optional weighted mean pose with covariance (row major x, y, theta)
+          if (report_pose_estimate) {
+            const PoseEstimate& estimate = pf.GetPoseEstimate();
+            msgJson["mean_x"] = estimate.x;
+            msgJson["mean_y"] = estimate.y;
+            msgJson["mean_theta"] = estimate.theta;
+            vector<double> cov;
+            for (int r = 0; r < 3; ++r) {
+              for (int c = 0; c < 3; ++c) {
+                cov.push_back(estimate.cov[r][c]);
+              }
+            }
+            msgJson["mean_covariance"] = cov;
+          }
+
+          // Optional heaviest modes of the cloud as [x, y, theta, weight]
+          if (num_reported_modes > 0) {
+            vector<vector<double>> modes;
+            for (const PoseMode& mode : pf.FindModes(num_reported_modes)) {
+              modes.push_back({mode.x, mode.y, mode.theta, mode.weight});
+            }
+            msgJson["modes"] = modes;
+          }
+
+          // Resample once the weighted set has been reported
+          pf.resample();
+          pf.PrintAllParticlesData(debugfile);
+
           // Optional message data used for debugging particle's sensing 
           //   and associations
           msgJson["best_particle_associations"] = pf.getAssociations(best_particle);
@@ -0,0 +1,102 @@
+/**
+ * motion_model.h
+ * CTRV (constant turn rate and velocity) motion model and the heading
+ * noise rotation, shared by the particle filters, the pose EKF and the
+ * fleet engine.
+ */
+
+#ifndef MOTION_MODEL_H_
+#define MOTION_MODEL_H_
+
+#include <math.h>
+
+/**
+ * Noiseless CTRV motion over one time step.
+ *
+ * The heading turns by the same angle for every pose, so the sine and
+ * cosine of the new heading follow from those of the old one by angle
+ * addition. The displacement is radius * (sin change, -cos change) when
+ * turning and step * (cos, sin) when driving straight, computed as one
+ * expression without a branch per pose so loops over poses vectorize.
+ */
+template <class Scalar>
+class CtrvModel {
+ public:
+  /**
+   * @param delta_t Time step [s]
+   * @param velocity Velocity [m/s]
+   * @param yaw_rate Yaw rate [rad/s]
+   */
+  CtrvModel(Scalar delta_t, Scalar velocity, Scalar yaw_rate) {
+    const bool turning = fabs(yaw_rate) > Scalar(0.0001);
+    d_theta = yaw_rate * delta_t;
+    cos_d = cos(d_theta);
+    sin_d = sin(d_theta);
+    radius = turning ? velocity / yaw_rate : Scalar(0);
+    step = turning ? Scalar(0) : velocity * delta_t;
+  }
+
+  /**
+   * Cosine and sine (c1, s1) of the heading after the step, from those of
+   *   the heading before it (c0, s0).
+   */
+  void Turn(Scalar c0, Scalar s0, Scalar& c1, Scalar& s1) const {
+    c1 = c0 * cos_d - s0 * sin_d;
+    s1 = s0 * cos_d + c0 * sin_d;
+  }
+
+  /**
+   * Move the position (x, y) of a pose with heading cosine and sine
+   *   (c0, s0). Sets (c1, s1) to those of the new heading, which is the old
+   *   one plus DeltaTheta().
+   */
+  void Move(Scalar& x, Scalar& y, Scalar c0, Scalar s0, Scalar& c1, Scalar& s1) const {
+    Turn(c0, s0, c1, s1);
+    x += radius * (s1 - s0) + step * c0;
+    y += radius * (c0 - c1) + step * s0;
+  }
+
+  /**
+   * Derivatives of the new position by the old heading, for the EKF
+   *   Jacobian, given the old and new heading cosine and sine.
+   */
+  void HeadingJacobian(Scalar c0, Scalar s0, Scalar c1, Scalar s1,
+                       Scalar& dx_dtheta, Scalar& dy_dtheta) const {
+    dx_dtheta = radius * (c1 - c0) - step * s0;
+    dy_dtheta = radius * (s1 - s0) + step * c0;
+  }
+
+  // Heading change of the step [rad]
+  Scalar DeltaTheta() const { return d_theta; }
+
+ private:
+  Scalar d_theta;
+  Scalar cos_d;
+  Scalar sin_d;
+  Scalar radius;  // Turn radius, 0 when driving straight
+  Scalar step;    // Straight line distance, 0 when turning
+};
+
+// Largest heading noise [rad] RotateHeadingSeries() is accurate for
+const double kHeadingSeriesRange = 0.1;
+
+/**
+ * Rotate the heading cosine and sine (c, s) by a small angle e, with e's
+ *   cosine and sine from their series, and renormalize so rounding does not
+ *   accumulate over steps. Accurate to double precision for
+ *   |e| < kHeadingSeriesRange; callers take cos and sin beyond it. Free of
+ *   branches, so loops over poses vectorize.
+ */
+template <class Scalar>
+inline void RotateHeadingSeries(Scalar e, Scalar& c, Scalar& s) {
+  const Scalar e2 = e * e;
+  const Scalar ce = 1 - e2 * (Scalar(1.0 / 2.0) - e2 * (Scalar(1.0 / 24.0) - e2 * Scalar(1.0 / 720.0)));
+  const Scalar se = e * (1 - e2 * (Scalar(1.0 / 6.0) - e2 * (Scalar(1.0 / 120.0) - e2 * Scalar(1.0 / 5040.0))));
+  const Scalar c1 = c * ce - s * se;
+  const Scalar s1 = s * ce + c * se;
+  const Scalar inv = 1 / sqrt(c1 * c1 + s1 * s1);
+  c = c1 * inv;
+  s = s1 * inv;
+}
+
+#endif  // MOTION_MODEL_H_
@@ -0,0 +1,259 @@
+/**
+ * parallel.h
+ * Thread parallel loops and reductions with thread count independent results.
+ *
+ * Work is always split into the same fixed size blocks, whatever the number
+ * of threads. Threads only decide who computes a block, never how the block
+ * results are combined: reductions store one partial per block and merge the
+ * partials with a fixed pairwise tree. Results are therefore bit-identical
+ * for any thread count.
+ *
+ * The threads belong to a WorkerPool that lives as long as its owner, so a
+ * loop only wakes them instead of starting and joining threads.
+ */
+
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Number of elements per reduction block
+static const int kReduceBlock = 256;
+
+/**
+ * Number of blocks of size 'grain' covering [0, n).
+ */
+inline int NumBlocks(int n, int grain) {
+  return (n + grain - 1) / grain;
+}
+
+/**
+ * Persistent worker threads. The calling thread works as worker 0, so a pool
+ *   of N threads starts N-1. Jobs are not reentrant: a job started from
+ *   inside a job of the same pool runs serially on the calling thread.
+ */
+class WorkerPool {
+ public:
+  WorkerPool() : num_threads(1), task(NULL), task_fn(NULL), task_blocks(0),
+                 next_block(0), generation(0), pending(0), stopping(false), busy(false) {}
+
+  ~WorkerPool() {
+    Stop();
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /**
+   * Set the number of threads, including the calling thread.
+   */
+  void Resize(int threads) {
+    threads = std::max(1, threads);
+    if (threads == num_threads) {
+      return;
+    }
+    Stop();
+    stopping = false;
+    num_threads = threads;
+    for (int w=1; w<num_threads; w++)
+    {
+      pool.push_back(std::thread(&WorkerPool::WorkerLoop, this, w));
+    }
+  }
+
+  int NumThreads() const { return num_threads; }
+
+  /**
+   * Call fn(worker, block) for every block in [0, numBlocks). Blocks are
+   *   handed out dynamically; 'worker' in [0, NumThreads()) identifies the
+   *   calling thread, so per thread resources can be used without locking.
+   */
+  template <class Fn>
+  void Run(int numBlocks, Fn& fn) {
+    if (num_threads == 1 || numBlocks <= 1 || busy.exchange(true))
+    {
+      for (int b=0; b<numBlocks; b++)
+      {
+        fn(0, b);
+      }
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      task = &Invoke<Fn>;
+      task_fn = &fn;
+      task_blocks = numBlocks;
+      next_block = 0;
+      pending = num_threads - 1;
+      generation++;
+    }
+    wake.notify_all();
+    Work(0);
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return pending == 0; });
+    }
+    busy = false;
+  }
+
+ private:
+  template <class Fn>
+  static void Invoke(void* fn, int worker, int block) {
+    (*static_cast<Fn*>(fn))(worker, block);
+  }
+
+  void Work(int worker) {
+    for (int b = next_block++; b < task_blocks; b = next_block++)
+    {
+      task(task_fn, worker, b);
+    }
+  }
+
+  void WorkerLoop(int worker) {
+    unsigned long long seen = 0;
+    for (;;)
+    {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) {
+          return;
+        }
+        seen = generation;
+      }
+      Work(worker);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending == 0) {
+          done.notify_one();
+        }
+      }
+    }
+  }
+
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& th : pool)
+    {
+      th.join();
+    }
+    pool.clear();
+    num_threads = 1;
+  }
+
+  int num_threads;
+  std::vector<std::thread> pool;
+
+  // Current job, published under 'mutex' by bumping 'generation'
+  void (*task)(void*, int, int);
+  void* task_fn;
+  int task_blocks;
+  std::atomic<int> next_block;
+  unsigned long long generation;
+  int pending;  // Workers other than the caller still in the job
+  bool stopping;
+  std::atomic<bool> busy;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+};
+
+/**
+ * Call fn(worker, block, begin, end) for every block of size 'grain' in
+ *   [0, n) on the threads of 'workers'. Blocks are handed out dynamically;
+ *   'worker' in [0, workers.NumThreads()) identifies the calling thread,
+ *   so per thread resources can be used without locking.
+ */
+template <class Fn>
+void ParallelForWorkers(int n, int grain, WorkerPool& workers, Fn fn) {
+  auto block = [&](int worker, int b) {
+    fn(worker, b, b * grain, std::min(n, (b + 1) * grain));
+  };
+  workers.Run(NumBlocks(n, grain), block);
+}
+
+/**
+ * Call fn(block, begin, end) for every block of size 'grain' in [0, n)
+ *   on the threads of 'workers'. Blocks are handed out dynamically.
+ */
+template <class Fn>
+void ParallelFor(int n, int grain, WorkerPool& workers, Fn fn) {
+  ParallelForWorkers(n, grain, workers, [&](int worker, int block, int begin, int end) {
+    fn(block, begin, end);
+  });
+}
+
+/**
+ * Merge per block partials with a fixed pairwise tree. The result is
+ *   left in partials[0].
+ */
+template <class Vector, class Combine>
+void PairwiseCombine(Vector& partials, Combine combine) {
+  for (size_t stride=1; stride<partials.size(); stride*=2)
+  {
+    for (size_t i=0; i+stride<partials.size(); i+=2*stride)
+    {
+      partials[i] = combine(partials[i], partials[i + stride]);
+    }
+  }
+}
+
+/**
+ * Deterministic parallel reduction over [0, n).
+ * @param leaf leaf(begin, end) reduces one block serially and returns a T
+ * @param combine combine(a, b) merges two partial results, a before b
+ * @param identity Result for an empty range
+ * @param alloc Allocator of the per block partials
+ */
+template <class T, class Leaf, class Combine, class Alloc>
+T ParallelReduce(int n, WorkerPool& workers, const T& identity, Leaf leaf, Combine combine,
+                 const Alloc& alloc) {
+  const int numBlocks = NumBlocks(n, kReduceBlock);
+  if (numBlocks == 0)
+  {
+    return identity;
+  }
+
+  std::vector<T, Alloc> partials(numBlocks, identity, alloc);
+  ParallelFor(n, kReduceBlock, workers, [&](int block, int begin, int end) {
+    partials[block] = leaf(begin, end);
+  });
+  PairwiseCombine(partials, combine);
+  return partials[0];
+}
+
+template <class T, class Leaf, class Combine>
+T ParallelReduce(int n, WorkerPool& workers, const T& identity, Leaf leaf, Combine combine) {
+  return ParallelReduce(n, workers, identity, leaf, combine, std::allocator<T>());
+}
+
+/**
+ * Deterministic parallel sum of term(i) over [0, n).
+ */
+template <class Term>
+double ParallelSum(int n, WorkerPool& workers, Term term) {
+  return ParallelReduce(n, workers, 0.0,
+    [&](int begin, int end) {
+      double sum = 0.0;
+      for (int i=begin; i<end; i++)
+      {
+        sum += term(i);
+      }
+      return sum;
+    },
+    [](double a, double b) { return a + b; });
+}
+
+#endif  // PARALLEL_H_
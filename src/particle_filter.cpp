@@ -8,20 +8,144 @@
 #include "particle_filter.h"
 
 #include <math.h>
+#include <string.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <numeric>
 #include <random>
 #include <string>
 #include <vector>
 
 #include "helper_functions.h"
+#include "motion_model.h"
+#include "parallel.h"
 
 using std::string;
 using std::vector;
 using std::normal_distribution;
 
+// Number of nearest neighbours kept per landmark for the cache local search
+static const int kNeighboursPerLandmark = 8;
+
+// Memory bound of the coarse likelihood field of two-stage weighting
+static const size_t kCoarseFieldMaxBytes = 16 * 1024 * 1024;
+
+// Observations scored by the coarse stage of two-stage weighting
+static const size_t kCoarseObservations = 4;
+
+// Side length of the density cells used by global initialization [m]
+static const double kGlobalInitCellSize = 10.0;
+
+// Position variance [m^2] below which a globally initialized filter is
+//   considered converged and starts shrinking its particle set
+static const double kConvergedPositionVar = 4.0;
+
+// Number of particles KLD-sampling needs so that, with probability 1 - delta,
+//   the KL divergence between the sample based and the true posterior stays
+//   below epsilon, given 'k' occupied histogram bins (Fox, 2003)
+static double KldBound(int k, double epsilon, double z)
+{
+  if (k < 2)
+  {
+    return 0.0;
+  }
+  double a = 2.0 / (9.0 * (k - 1));
+  double b = 1.0 - a + sqrt(a) * z;
+  return (k - 1) / (2.0 * epsilon) * b * b * b;
+}
+
+// Adds its lifetime to the time of the hybrid filter mode that was active
+//   when it was created
+class ModeTimer {
+ public:
+  explicit ModeTimer(HybridStats& stats)
+    : stats(stats), ekf(stats.ekf_active), start(std::chrono::steady_clock::now()) {}
+  ~ModeTimer() {
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    (ekf ? stats.ekf_ms : stats.pf_ms) += ms;
+  }
+ private:
+  HybridStats& stats;
+  bool ekf;
+  std::chrono::steady_clock::time_point start;
+};
+
+// log(exp(a) + exp(b)) without overflow or underflow
+static double LogAddExp(double a, double b)
+{
+  if (a == -HUGE_VAL)
+  {
+    return b;
+  }
+  if (b == -HUGE_VAL)
+  {
+    return a;
+  }
+  double m = std::max(a, b);
+  return m + log(exp(a - m) + exp(b - m));
+}
+
+// Set the heading of a particle together with its cached sine and cosine
+static void SetTheta(Particle& p, double theta)
+{
+  p.theta = theta;
+  p.cos_theta = cos(theta);
+  p.sin_theta = sin(theta);
+}
+
+// Rotate the cached heading of a particle by a small angle 'e', using the
+//   series of sin and cos, and put it back on the unit circle
+static void RotateHeading(Particle& p, double e)
+{
+  if (fabs(e) < kHeadingSeriesRange)
+  {
+    RotateHeadingSeries(e, p.cos_theta, p.sin_theta);
+    return;
+  }
+  double ce = cos(e);
+  double se = sin(e);
+  double c = p.cos_theta * ce - p.sin_theta * se;
+  double s = p.sin_theta * ce + p.cos_theta * se;
+  double inv = 1.0 / sqrt(c * c + s * s);
+  p.cos_theta = c * inv;
+  p.sin_theta = s * inv;
+}
+
+// Id of the predicted landmark nearest to (x, y), -1 if there is none
+static int NearestLandmarkId(const vector<LandmarkObs>& predicted, double x, double y)
+{
+  double minDist = 9.9e50; // large number
+  int bestId = -1;
+  for (const auto& pred : predicted)
+  {
+    double d = dist(pred.x, pred.y, x, y); 
+    if (d < minDist)
+    {
+      minDist = d;
+      bestId = pred.id;
+    }
+  } 
+  return bestId;
+}
+
+// Predicted landmark with the given id; far away if none, so an unmatched
+//   observation gets a negligible likelihood
+static LandmarkObs PredictedById(const vector<LandmarkObs>& predicted, int id)
+{
+  for (const auto& pred : predicted)
+  {
+    if (pred.id == id)
+    {
+      return pred;
+    }
+  }
+  LandmarkObs none = {-1, 9.9e50, 9.9e50};
+  return none;
+}
 
 void ParticleFilter::init(double x, double y, double theta, double std[]) {
   /**
@@ -32,22 +156,28 @@ void ParticleFilter::init(double x, double y, double theta, double std[]) {
    * NOTE: Consult particle_filter.h for more information about this method 
    *   (and others in this file).
    */
-  num_particles = 100;  //  Set the number of particles
+  num_particles = init_particles;  //  Set the number of particles
+  target_particles = num_particles;
+  multiplicity.clear();
 
-  // This line creates a normal (Gaussian) distribution for x, y and theta
-  std::default_random_engine randGen;
-  normal_distribution<double> dist_x(x, std[0]);
-  normal_distribution<double> dist_y(y, std[1]);
-  normal_distribution<double> dist_theta(theta, std[2]);
+  // Gaussian samples around the first position for x, y and theta
+  ArenaAllocator<double> alloc(frame_arena);
+  ArenaVector<double> init_x(num_particles, 0.0, alloc);
+  ArenaVector<double> init_y(num_particles, 0.0, alloc);
+  ArenaVector<double> init_theta(num_particles, 0.0, alloc);
+  noise_rng.FillNormal(init_x.data(), num_particles, x, std[0]);
+  noise_rng.FillNormal(init_y.data(), num_particles, y, std[1]);
+  noise_rng.FillNormal(init_theta.data(), num_particles, theta, std[2]);
 
   for (int n=0; n<num_particles; n++)
   {
     Particle newParticle;
 
-    newParticle.x = dist_x(randGen);
-    newParticle.y = dist_y(randGen);
-    newParticle.theta = dist_theta(randGen);
+    newParticle.x = init_x[n];
+    newParticle.y = init_y[n];
+    SetTheta(newParticle, init_theta[n]);
     newParticle.weight = 1.0;
+    newParticle.log_weight = 0.0;
     newParticle.id = n;
 
     particles.push_back(newParticle);    
@@ -57,8 +187,82 @@ void ParticleFilter::init(double x, double y, double theta, double std[]) {
 
 }
 
+void ParticleFilter::InitGlobal(const Map &map_landmarks, double sensor_range,
+                                int initial_particles, int converged_particles,
+                                bool density_weighted) {
+  if (!landmark_index.IsBuiltFrom(map_landmarks))
+  {
+    landmark_index.Build(map_landmarks, sensor_range, kNeighboursPerLandmark);
+    likelihood_field_stale = true;
+    coarse_field_stale = true;
+  }
+  const LandmarkIndex& index = landmark_index;
+
+  num_particles = initial_particles;
+  target_particles = num_particles;
+  this->converged_particles = converged_particles;
+
+  // Cells covering the bounding box of the map, weighted uniformly or by
+  //   the number of landmarks a vehicle in the cell could observe
+  int cellsX = std::max(1, (int)ceil((index.max_x - index.min_x) / kGlobalInitCellSize));
+  int cellsY = std::max(1, (int)ceil((index.max_y - index.min_y) / kGlobalInitCellSize));
+  double cellW = (index.max_x - index.min_x) / cellsX;
+  double cellH = (index.max_y - index.min_y) / cellsY;
+
+  vector<double> cellWeights(cellsX * cellsY, 1.0);
+  if (density_weighted)
+  {
+    vector<int> inRange;
+    for (int cx=0; cx<cellsX; cx++)
+    {
+      for (int cy=0; cy<cellsY; cy++)
+      {
+        double x = index.min_x + (cx + 0.5) * cellW;
+        double y = index.min_y + (cy + 0.5) * cellH;
+        index.QueryRange(x, y, sensor_range, inRange);
+        cellWeights[cx * cellsY + cy] = 1.0 + inRange.size();
+      }
+    }
+  }
+
+  std::default_random_engine randGen;
+  std::discrete_distribution<int> dist_cell(cellWeights.begin(), cellWeights.end());
+  std::uniform_real_distribution<double> dist_unit(0.0, 1.0);
+  std::uniform_real_distribution<double> dist_theta(-M_PI, M_PI);
+
+  particles.clear();
+  multiplicity.clear();
+  for (int n=0; n<num_particles; n++)
+  {
+    int cell = dist_cell(randGen);
+    Particle newParticle;
+
+    newParticle.x = index.min_x + (cell / cellsY + dist_unit(randGen)) * cellW;
+    newParticle.y = index.min_y + (cell % cellsY + dist_unit(randGen)) * cellH;
+    SetTheta(newParticle, dist_theta(randGen));
+    newParticle.weight = 1.0;
+    newParticle.log_weight = 0.0;
+    newParticle.id = n;
+
+    particles.push_back(newParticle);
+  }
+
+  is_initialized = true;
+}
+
 void ParticleFilter::prediction(double delta_t, double std_pos[], 
                                 double velocity, double yaw_rate) {
+  ModeTimer timer(hybrid_stats);
+  frame_arena.Reset();  // also when the last step was not resampled
+  step_start = std::chrono::steady_clock::now();
+  step_started = true;
+
+  if (hybrid_stats.ekf_active)
+  {
+    ekf.Predict(delta_t, std_pos, velocity, yaw_rate);
+    return;
+  }
+
   /**
    * Add measurements to each particle and add random Gaussian noise.
    * NOTE: When adding noise you may find std::normal_distribution 
@@ -66,30 +270,67 @@ void ParticleFilter::prediction(double delta_t, double std_pos[],
    *  http://en.cppreference.com/w/cpp/numeric/random/normal_distribution
    *  http://www.cplusplus.com/reference/random/default_random_engine/
    */
-  // This line creates a normal (Gaussian) distribution for x, y and theta
-  std::default_random_engine randGen;
-  normal_distribution<double> dist_x(0, std_pos[0]);
-  normal_distribution<double> dist_y(0, std_pos[1]);
-  normal_distribution<double> dist_theta(0, std_pos[2]);
+  // Gaussian noise for x, y and theta of all particles, generated in batches
+  //   before the motion loop
+  ArenaAllocator<double> alloc(frame_arena);
+  ArenaVector<double> noise_x(num_particles, 0.0, alloc);
+  ArenaVector<double> noise_y(num_particles, 0.0, alloc);
+  ArenaVector<double> noise_theta(num_particles, 0.0, alloc);
+  noise_rng.FillNormal(noise_x.data(), num_particles, 0.0, std_pos[0]);
+  noise_rng.FillNormal(noise_y.data(), num_particles, 0.0, std_pos[1]);
+  noise_rng.FillNormal(noise_theta.data(), num_particles, 0.0, std_pos[2]);
 
-  for (int n=0; n<num_particles; n++)
+  // CTRV motion from the cached sine and cosine of the heading
+  const CtrvModel<double> motion(delta_t, velocity, yaw_rate);
+  auto move = [&](Particle& p, int n) {
+    motion.Move(p.x, p.y, p.cos_theta, p.sin_theta, p.cos_theta, p.sin_theta);
+    p.x += noise_x[n];
+    p.y += noise_y[n];
+    double noise = noise_theta[n];
+    p.theta += motion.DeltaTheta() + noise;
+    RotateHeading(p, noise);
+  };
+
+  if (multiplicity.empty())
   {
-    if (abs(yaw_rate) > 0.0001)
+    for (int n=0; n<num_particles; n++)
     {
-      particles[n].x += velocity / yaw_rate * (sin(particles[n].theta + yaw_rate * delta_t) - sin(particles[n].theta)) + dist_x(randGen);
-      particles[n].y += velocity / yaw_rate * (-cos(particles[n].theta + yaw_rate * delta_t) + cos(particles[n].theta)) + dist_y(randGen);
-      particles[n].theta += yaw_rate * delta_t + dist_theta(randGen);
+      move(particles[n], n);
     }
-    else // for small yaw_rate
+    return;
+  }
+
+  // Expand an encoded set while moving it, every copy with its own noise
+  back_particles.resize(num_particles);
+  int out = 0;
+  for (uint k=0; k<multiplicity.size(); k++)
+  {
+    for (int c=0; c<multiplicity[k]; c++)
     {
-      particles[n].x += velocity*cos(particles[n].theta)*delta_t + dist_x(randGen);
-      particles[n].y += velocity*sin(particles[n].theta)*delta_t + dist_y(randGen);
-      particles[n].theta += yaw_rate * delta_t + dist_theta(randGen);      
-    }    
-  } 
+      back_particles[out] = particles[k];
+      move(back_particles[out], out);
+      out++;
+    }
+  }
+  particles.swap(back_particles);
+  multiplicity.clear();
 }
 
-void ParticleFilter::dataAssociation(vector<LandmarkObs> predicted, 
+void ParticleFilter::ExpandParticles() {
+  back_particles.resize(num_particles);
+  int out = 0;
+  for (uint k=0; k<multiplicity.size(); k++)
+  {
+    for (int c=0; c<multiplicity[k]; c++)
+    {
+      back_particles[out++] = particles[k];
+    }
+  }
+  particles.swap(back_particles);
+  multiplicity.clear();
+}
+
+void ParticleFilter::dataAssociation(const vector<LandmarkObs>& predicted, 
                                      vector<LandmarkObs>& observations) {
   /**
    * Find the predicted measurement that is closest to each 
@@ -101,20 +342,205 @@ void ParticleFilter::dataAssociation(vector<LandmarkObs> predicted,
    */
   for (auto& obs : observations)
   {
-    double minDist = 9.9e50; // large number
-    LandmarkObs bestFit;
-    for (auto pred : predicted)
+    obs.id = NearestLandmarkId(predicted, obs.x, obs.y);
+  }
+
+}
+
+double ParticleFilter::AssociateByAssignment(double std_landmark[], const vector<LandmarkObs>& predicted,
+                                             vector<LandmarkObs>& observations,
+                                             WeightScratch& scratch) const {
+  const int rows = (int)observations.size();
+  const int numPred = (int)predicted.size();
+  const double gate = assignment_gate;
+  const double invVarX = 1.0 / (std_landmark[0] * std_landmark[0]);
+  const double invVarY = 1.0 / (std_landmark[1] * std_landmark[1]);
+
+  // Squared Mahalanobis distances and the nearest landmark in each gate
+  vector<double>& d2 = scratch.gate_dist;
+  vector<int>& assigned = scratch.assigned;
+  vector<int>& claims = scratch.claims;
+  d2.resize((size_t)rows * numPred);
+  assigned.assign(rows, -1);
+  claims.assign(numPred, 0);
+  bool conflict = false;
+  for (int i=0; i<rows; i++)
+  {
+    double best = gate;
+    for (int k=0; k<numPred; k++)
     {
-      double d = dist(pred.x, pred.y, obs.x, obs.y); 
-      if (d < minDist)
+      double dx = observations[i].x - predicted[k].x;
+      double dy = observations[i].y - predicted[k].y;
+      double d = dx * dx * invVarX + dy * dy * invVarY;
+      d2[(size_t)i * numPred + k] = d;
+      if (d < best)
       {
-        minDist = d;
-        bestFit = pred;
+        best = d;
+        assigned[i] = k;
+      }
+    }
+    if (assigned[i] >= 0 && claims[assigned[i]]++ > 0)
+    {
+      conflict = true;
+    }
+  }
+
+  // Without a shared landmark every observation is at its row minimum,
+  //   which is optimal. Otherwise solve the assignment on the gated
+  //   subgraph: the observations with a landmark in their gate, the
+  //   landmarks in at least one gate, and one miss column per observation
+  //   that costs the gate.
+  if (conflict)
+  {
+    auto start = std::chrono::steady_clock::now();
+    vector<int>& rowObs = scratch.gated_rows;
+    vector<int>& colLandmark = scratch.gated_cols;
+    vector<int>& colOf = scratch.gated_col_of;
+    rowObs.clear();
+    colLandmark.clear();
+    colOf.assign(numPred, -1);
+    for (int i=0; i<rows; i++)
+    {
+      if (assigned[i] < 0) {
+        continue;  // outside every gate, only the miss column is left
+      }
+      rowObs.push_back(i);
+      for (int k=0; k<numPred; k++)
+      {
+        if (d2[(size_t)i * numPred + k] < gate && colOf[k] < 0)
+        {
+          colOf[k] = (int)colLandmark.size();
+          colLandmark.push_back(k);
+        }
+      }
+    }
+
+    const double kNoEdge = 1e9;
+    const int gatedRows = (int)rowObs.size();
+    const int gatedCols = (int)colLandmark.size();
+    const int cols = gatedCols + gatedRows;
+    vector<double>& cost = scratch.assignment_cost;
+    cost.assign((size_t)gatedRows * cols, kNoEdge);
+    for (int r=0; r<gatedRows; r++)
+    {
+      const double* rowDist = &d2[(size_t)rowObs[r] * numPred];
+      for (int c=0; c<gatedCols; c++)
+      {
+        double d = rowDist[colLandmark[c]];
+        if (d < gate) {
+          cost[(size_t)r * cols + c] = d;
+        }
       }
-    } 
-    obs.id = bestFit.id;      
+      cost[(size_t)r * cols + gatedCols + r] = gate;
+    }
+    vector<int>& rowToCol = scratch.gated_match;
+    scratch.solver.Solve(cost, gatedRows, cols, rowToCol);
+    for (int r=0; r<gatedRows; r++)
+    {
+      const int c = rowToCol[r];
+      assigned[rowObs[r]] = c < gatedCols ? colLandmark[c] : -1;
+    }
+    scratch.stats.assignment_solves++;
+    scratch.stats.assignment_ms += std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
   }
 
+  // An observation outside every gate keeps the distance to its nearest
+  //   landmark, one that lost its landmark in the assignment the gate
+  const double logNorm = -log(2.0 * M_PI * std_landmark[0] * std_landmark[1]);
+  double logWeight = 0.0;
+  for (int i=0; i<rows; i++)
+  {
+    int k = assigned[i];
+    double d = gate;
+    if (k < 0)
+    {
+      double nearest = HUGE_VAL;
+      for (int j=0; j<numPred; j++)
+      {
+        if (d2[(size_t)i * numPred + j] < nearest)
+        {
+          nearest = d2[(size_t)i * numPred + j];
+          k = j;
+        }
+      }
+      d = std::max(gate, nearest);
+      k = nearest >= gate ? k : -1;
+    }
+    else
+    {
+      d = d2[(size_t)i * numPred + k];
+    }
+    observations[i].id = k >= 0 ? predicted[k].id : -1;
+    logWeight += logNorm - 0.5 * d;
+  }
+  scratch.stats.lookups += rows;
+  return logWeight;
+}
+
+void ParticleFilter::AssociateWithCache(const Particle& particle, double sensor_range,
+                                        const vector<LandmarkObs>& predicted,
+                                        vector<LandmarkObs>& observations,
+                                        AssociationStats& stats) const {
+  for (uint m=0; m<observations.size(); m++)
+  {
+    observations[m].id = AssociateObservation(particle, m, sensor_range, predicted, observations[m], stats);
+  }
+}
+
+int ParticleFilter::AssociateObservation(const Particle& particle, uint m, double sensor_range,
+                                         const vector<LandmarkObs>& predicted,
+                                         const LandmarkObs& obs, AssociationStats& stats) const {
+  const LandmarkIndex& index = landmark_index;
+  stats.lookups++;
+
+  int cached = -1;
+  if (m < particle.associations.size())
+  {
+    cached = index.IndexOfId(particle.associations[m]);
+  }
+  // The cached landmark is only valid if it is among the predicted landmarks
+  if (cached >= 0 && dist(index.x[cached], index.y[cached], particle.x, particle.y) < sensor_range)
+  {
+    double dCached = dist(index.x[cached], index.y[cached], obs.x, obs.y);
+
+    // Gate: closer than half way to the nearest other landmark means no
+    //   other landmark can be closer (triangle inequality)
+    if (2.0 * dCached < index.NearestNeighbourDist(cached))
+    {
+      stats.gate_hits++;
+      return index.id[cached];
+    }
+
+    // Bounded local search among the neighbours of the cached landmark
+    int best = cached;
+    double bestDist = dCached;
+    const int* nb = index.Neighbours(cached);
+    for (int k=0; k<index.NumNeighbours(cached); k++)
+    {
+      int cand = nb[k];
+      if (dist(index.x[cand], index.y[cand], particle.x, particle.y) >= sensor_range)
+      {
+        continue;
+      }
+      double d = dist(index.x[cand], index.y[cand], obs.x, obs.y);
+      if (d < bestDist || (d == bestDist && cand < best))
+      {
+        bestDist = d;
+        best = cand;
+      }
+    }
+    // Landmarks outside the neighbour list are at least
+    //   NeighbourRadius - dCached away from the observation
+    if (bestDist < index.NeighbourRadius(cached) - dCached)
+    {
+      stats.local_hits++;
+      return index.id[best];
+    }
+  }
+
+  // Gate failed, full search
+  return NearestLandmarkId(predicted, obs.x, obs.y);
 }
 
   /**
@@ -124,34 +550,25 @@ void ParticleFilter::dataAssociation(vector<LandmarkObs> predicted,
   void ParticleFilter::CalculateParticleWeight(Particle& particle, double std_landmark[], const vector<LandmarkObs> &predictedLandMarks) 
   {
 
-  double weight = 1.0;  // particle weight
+  double logWeight = 0.0;  // log of particle weight
 
   // Loop through associations and calcualte partial probability
   for (uint n=0; n < particle.associations.size(); n++)
   {
-    int lmId = particle.associations[n];
+    // No landmark in range explains the observation unless a match is found
+    LandmarkObs pred_LM_match = PredictedById(predictedLandMarks, particle.associations[n]);
 
-    LandmarkObs pred_LM_match;
-    // Find LM association in 
-    for (auto pred_LM : predictedLandMarks)
-    {
-      if (lmId == pred_LM.id)
-      {
-        pred_LM_match = pred_LM;
-        break;
-      }
-    }
-    
-    // Calculate probability
-    weight *= multiv_prob(std_landmark[0], std_landmark[1], particle.sense_x[n], particle.sense_y[n], pred_LM_match.x, pred_LM_match.y);
+    // Calculate probability, summed in the log domain
+    logWeight += log_multiv_prob(std_landmark[0], std_landmark[1], particle.sense_x[n], particle.sense_y[n], pred_LM_match.x, pred_LM_match.y);
   }
 
   // Update weight  
-  particle.weight = weight;
+  particle.log_weight = logWeight;
+  particle.weight = exp(logWeight);
 }
 
 void ParticleFilter::updateWeights(double sensor_range, double std_landmark[], 
-                                   const vector<LandmarkObs> &observations, 
+                                   const vector<LandmarkObs> &all_observations, 
                                    const Map &map_landmarks) {
   /**
    * Update the weights of each particle using a mult-variate Gaussian 
@@ -167,70 +584,1100 @@ void ParticleFilter::updateWeights(double sensor_range, double std_landmark[],
    *   (look at equation 3.33) http://planning.cs.uiuc.edu/node99.html
    */
 
-  vector<LandmarkObs> observations_mapCoordinates;
-  vector<LandmarkObs> predictedLMs;
+  ModeTimer timer(hybrid_stats);
+  frame_arena.Reset();  // also in EKF mode, which never resamples
+
+  // Bounded subset of the observations, selected once for all particles
+  const vector<LandmarkObs>& observations = SelectObservations(all_observations);
+
+  PrepareMap(map_landmarks, sensor_range, std_landmark, use_two_stage && step_budget_ms <= 0.0);
+
+  // In EKF mode only fall through to the particles if the EKF lost track
+  if (hybrid_stats.ekf_active)
+  {
+    if (EkfUpdate(sensor_range, std_landmark, observations))
+    {
+      hybrid_stats.ekf_steps++;
+      step_started = false;
+      return;
+    }
+    ExpandFromEkf();
+  }
+  hybrid_stats.pf_steps++;
+
+  // An encoded set is weighted once per parent and expanded afterwards.
+  //   The deadline and two-stage modes draw per particle, so they expand first.
+  const int logicalParticles = num_particles;
+  bool sharedWeighting = !multiplicity.empty();
+  if (sharedWeighting && (step_budget_ms > 0.0 || use_two_stage))
+  {
+    ExpandParticles();
+    sharedWeighting = false;
+  }
+  if (sharedWeighting)
+  {
+    num_particles = (int)particles.size();
+  }
+
+  // Particles are independent, update them in blocks on the worker threads
+  const int grain = 64;
+  ArenaVector<AssociationStats> blockStats(NumBlocks(num_particles, grain), AssociationStats(),
+                                           ArenaAllocator<AssociationStats>(frame_arena));
+  if ((int)worker_scratch.size() < num_threads)
+  {
+    worker_scratch.resize(num_threads);
+  }
+  std::atomic<double> bestLogWeight(-HUGE_VAL);
+
+  if (step_budget_ms > 0.0)
+  {
+    // Anytime update: visit particles in random order until the deadline
+    typedef std::chrono::steady_clock Clock;
+    if (!step_started)
+    {
+      step_start = Clock::now();
+    }
+    // Leave time for normalizing and resampling the set
+    const Clock::time_point deadline = step_start +
+      std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(step_budget_ms)) -
+      std::chrono::nanoseconds(tail_ns_estimate * num_particles);
+
+    visit_order.resize(num_particles);
+    std::iota(visit_order.begin(), visit_order.end(), 0);
+    std::shuffle(visit_order.begin(), visit_order.end(), step_gen);
+
+    // Measured duration of one block, carried over between steps
+    std::atomic<int> reached(0);
+    std::atomic<long long> blockNs(block_ns_estimate);
+    ParallelForWorkers(num_particles, grain, workers, [&](int worker, int block, int begin, int end) {
+      // Skip the block if it is not expected to finish in time. The first
+      //   block always runs so the step keeps some particles.
+      Clock::time_point blockStart = Clock::now();
+      if (block > 0 && blockStart + std::chrono::nanoseconds(blockNs.load()) > deadline)
+      {
+        for (int k=begin; k<end; k++)
+        {
+          particles[visit_order[k]].weight = 0.0;
+          particles[visit_order[k]].log_weight = -HUGE_VAL;
+        }
+        return;
+      }
+
+      WeightScratch& scratch = worker_scratch[worker];
+      scratch.stats = AssociationStats();
+      scratch.best_log_weight = &bestLogWeight;
+      for (int k=begin; k<end; k++)
+      {
+        UpdateParticle(particles[visit_order[k]], sensor_range, std_landmark, observations, scratch);
+      }
+      blockStats[block] = scratch.stats;
+      reached += end - begin;
+      blockNs = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - blockStart).count();
+    });
+    block_ns_estimate = blockNs;
+
+    deadline_stats.reached = reached;
+    deadline_stats.shed = num_particles - reached;
+    deadline_stats.used_ms = std::chrono::duration<double, std::milli>(Clock::now() - step_start).count();
+    deadline_pending = true;
+  }
+  else
+  {
+    // Two-stage weighting: only the particles drawn by the coarse stage
+    //   are weighted exactly, their weights divided by the probability
+    //   they were drawn with
+    ArenaVector<double> inclusion(0, 0.0, ArenaAllocator<double>(frame_arena));
+    if (use_two_stage)
+    {
+      SelectForExactWeighting(observations, inclusion);
+    }
+
+    ParallelForWorkers(num_particles, grain, workers, [&](int worker, int block, int begin, int end) {
+      WeightScratch& scratch = worker_scratch[worker];
+      scratch.stats = AssociationStats();
+      scratch.best_log_weight = &bestLogWeight;
+      for (int n=begin; n<end; n++)
+      {
+        if (use_two_stage && inclusion[n] == 0.0)
+        {
+          particles[n].weight = 0.0;
+          particles[n].log_weight = -HUGE_VAL;
+          scratch.stats.coarse_skipped++;
+          continue;
+        }
+        UpdateParticle(particles[n], sensor_range, std_landmark, observations, scratch);
+        if (use_two_stage && inclusion[n] < 1.0)
+        {
+          particles[n].log_weight -= log(inclusion[n]);
+          particles[n].weight = exp(particles[n].log_weight);
+        }
+      }
+      blockStats[block] = scratch.stats;
+    });
+
+    // Every copy of a shared weighting counts as reached
+    deadline_stats.reached = logicalParticles;
+    deadline_stats.shed = 0;
+    deadline_stats.used_ms = 0.0;
+    deadline_stats.step_ms = 0.0;
+  }
+  step_started = false;
+  if (sharedWeighting)
+  {
+    num_particles = logicalParticles;
+    ExpandParticles();
+  }
+
+  // Auxiliary filter step: divide out the look-ahead likelihood the
+  //   particles were drawn with
+  if (aux_pending)
+  {
+    ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+      for (int n=begin; n<end; n++)
+      {
+        if (particles[n].weight > 0.0)
+        {
+          particles[n].log_weight -= aux_look[n];
+          particles[n].weight = exp(particles[n].log_weight);
+        }
+      }
+    });
+    aux_pending = false;
+  }
+
+  assoc_stats = AssociationStats();
+  for (const auto& bs : blockStats)
+  {
+    assoc_stats.lookups += bs.lookups;
+    assoc_stats.gate_hits += bs.gate_hits;
+    assoc_stats.local_hits += bs.local_hits;
+    assoc_stats.assignment_solves += bs.assignment_solves;
+    assoc_stats.assignment_ms += bs.assignment_ms;
+    assoc_stats.pruned += bs.pruned;
+    assoc_stats.coarse_skipped += bs.coarse_skipped;
+  }
+
+  NormalizeWeights(observations);
+}
+
+const vector<LandmarkObs>* ParticleFilter::BeginExternalStep(const vector<LandmarkObs>& observations,
+                                                             double field_resolution,
+                                                             size_t field_max_bytes) {
+  if (!is_initialized || hybrid_stats.ekf_active || !use_likelihood_field ||
+      field_resolution != this->field_resolution || field_max_bytes != this->field_max_bytes ||
+      step_budget_ms > 0.0 || use_two_stage)
+  {
+    return NULL;
+  }
+  ModeTimer timer(hybrid_stats);
+  frame_arena.Reset();
+  if (!multiplicity.empty())
+  {
+    ExpandParticles();
+  }
+  return &SelectObservations(observations);
+}
+
+void ParticleFilter::FinishExternalUpdate(const vector<LandmarkObs>& observations,
+                                          double external_ms) {
+  ModeTimer timer(hybrid_stats);
+  hybrid_stats.pf_ms += external_ms;
+  hybrid_stats.pf_steps++;
+  step_started = false;
+  assoc_stats = AssociationStats();
+  deadline_stats.reached = num_particles;
+  deadline_stats.shed = 0;
+  deadline_stats.used_ms = 0.0;
+  deadline_stats.step_ms = 0.0;
+  NormalizeWeights(observations);
+}
+
+void ParticleFilter::NormalizeWeights(const vector<LandmarkObs>& observations) {
+  // Normalize weights. The same reduction yields the posterior estimate.
+  WeightMoments moments = ReduceWeights();
+  double logScale = 0.0;  // log of the factor the weights were divided by
+  if (!(moments.sum > 1e-5))
+  {
+    // Weights underflowed (e.g. a kidnapped or globally initialized
+    //   filter), rescale them relative to the most likely particle
+    double maxLog = ParallelReduce(num_particles, workers, -HUGE_VAL,
+      [&](int begin, int end) {
+        double m = -HUGE_VAL;
+        for (int n=begin; n<end; n++)
+        {
+          m = std::max(m, particles[n].log_weight);
+        }
+        return m;
+      },
+      [](double a, double b) { return std::max(a, b); },
+      ArenaAllocator<double>(frame_arena));
+
+    ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+      for (int n=begin; n<end; n++)
+      {
+        particles[n].weight = std::isfinite(maxLog) ? exp(particles[n].log_weight - maxLog) : 1.0;
+      }
+    });
+    moments = ReduceWeights();
+    logScale = maxLog;
+  }
+  pose_estimate = EstimateFromMoments(moments);
+
+  // Augmented MCL: exponential averages of the mean measurement likelihood
+  //   over the weighted particles, kept in the log domain. The likelihood
+  //   is taken per observation so frames with more observations compare.
+  if (use_augmented_mcl && !observations.empty() && moments.sum > 0.0)
+  {
+    AugmentedMclStats& st = amcl_stats;
+    double logAvg = (logScale + log(moments.sum) - log((double)deadline_stats.reached)) / observations.size();
+    if (!std::isfinite(logAvg))
+    {
+      logAvg = -HUGE_VAL;
+    }
+    if (st.log_w_slow == -HUGE_VAL)
+    {
+      st.log_w_slow = st.log_w_fast = logAvg;
+    }
+    else
+    {
+      st.log_w_slow = LogAddExp(log(1.0 - amcl_alpha_slow) + st.log_w_slow, log(amcl_alpha_slow) + logAvg);
+      st.log_w_fast = LogAddExp(log(1.0 - amcl_alpha_fast) + st.log_w_fast, log(amcl_alpha_fast) + logAvg);
+    }
+    st.injection_prob = st.log_w_slow == -HUGE_VAL ? 0.0 :
+                        std::max(0.0, 1.0 - exp(st.log_w_fast - st.log_w_slow));
+    last_observations = observations;
+  }
+  double sum = moments.sum;
+  if (sum > 1e-5)  // avoid divide by 0
+  {
+    ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+      for (int n=begin; n<end; n++)
+      {
+        particles[n].weight = particles[n].weight / sum;
+      }
+    });
+  }
+
+  if (use_hybrid_ekf)
+  {
+    CheckCollapse();
+  }
+}
+
+const vector<LandmarkObs>& ParticleFilter::SelectObservations(const vector<LandmarkObs>& observations) {
+  if (observation_limit <= 0 || (int)observations.size() <= observation_limit)
+  {
+    return observations;
+  }
 
+  // Rank the observations by distance within their bearing sector, then
+  //   take them by rank: the nearest of every sector first, then the
+  //   second nearest, and so on
+  struct Key {
+    int rank;
+    int sector;
+    double range;
+    int index;
+  };
+  const int numSectors = observation_limit;
+  ArenaVector<Key> keys(observations.size(), Key(), ArenaAllocator<Key>(frame_arena));
+  for (uint m=0; m<observations.size(); m++)
+  {
+    double bearing = atan2(observations[m].y, observations[m].x);
+    int sector = (int)((bearing + M_PI) * (numSectors / (2.0 * M_PI)));
+    keys[m].rank = 0;
+    keys[m].sector = std::min(std::max(sector, 0), numSectors - 1);
+    keys[m].range = sqrt(observations[m].x * observations[m].x + observations[m].y * observations[m].y);
+    keys[m].index = m;
+  }
+  std::sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+    if (a.sector != b.sector) {
+      return a.sector < b.sector;
+    }
+    return a.range < b.range || (a.range == b.range && a.index < b.index);
+  });
+  for (uint k=1; k<keys.size(); k++)
+  {
+    keys[k].rank = keys[k].sector == keys[k - 1].sector ? keys[k - 1].rank + 1 : 0;
+  }
+  std::sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+    return a.rank < b.rank || (a.rank == b.rank && a.sector < b.sector);
+  });
+
+  // Keep the original order, which the association cache is keyed by
+  keys.resize(observation_limit);
+  std::sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+    return a.index < b.index;
+  });
+  observation_subset.clear();
+  for (const Key& key : keys)
+  {
+    observation_subset.push_back(observations[key.index]);
+  }
+  return observation_subset;
+}
+
+void ParticleFilter::PrepareMap(const Map& map_landmarks, double sensor_range,
+                                double std_landmark[], bool coarse) {
+  // (Re)build the landmark index if the map is new
+  if (!landmark_index.IsBuiltFrom(map_landmarks))
+  {
+    landmark_index.Build(map_landmarks, sensor_range, kNeighboursPerLandmark);
+    likelihood_field_stale = true;
+    coarse_field_stale = true;
+  }
+
+  // (Re)build the likelihood field if enabled and out of date
+  if (use_likelihood_field && (likelihood_field_stale || !likelihood_field.IsBuiltFor(std_landmark)))
+  {
+    likelihood_field.Build(landmark_index, std_landmark, sensor_range,
+                           field_resolution, field_max_bytes);
+    likelihood_field_stale = false;
+  }
+  if (coarse)
+  {
+    // Coarse field, with the likelihood widened to its spacing
+    double coarseStd[2] = {std::max(std_landmark[0], coarse_field_resolution),
+                           std::max(std_landmark[1], coarse_field_resolution)};
+    if (coarse_field_stale || !coarse_field.IsBuiltFor(coarseStd))
+    {
+      coarse_field.Build(landmark_index, coarseStd, sensor_range,
+                         coarse_field_resolution, kCoarseFieldMaxBytes);
+      coarse_field_stale = false;
+    }
+  }
+}
+
+double ParticleFilter::CoarseLogLikelihood(double x, double y, double cos_theta, double sin_theta,
+                                           const vector<LandmarkObs>& observations) const {
+  // Evenly spaced observations
+  const size_t stride = (observations.size() + kCoarseObservations - 1) / kCoarseObservations;
+  double logLik = 0.0;
+  for (size_t m=0; m<observations.size(); m+=stride)
+  {
+    const LandmarkObs& obs = observations[m];
+    logLik += coarse_field.LogLikelihood(x + cos_theta*obs.x - sin_theta*obs.y,
+                                         y + sin_theta*obs.x + cos_theta*obs.y);
+  }
+  return logLik;
+}
+
+void ParticleFilter::AuxiliaryStep(double delta_t, double std_pos[], double velocity, double yaw_rate,
+                                   double sensor_range, double std_landmark[],
+                                   const vector<LandmarkObs> &observations,
+                                   const Map &map_landmarks) {
+  if (hybrid_stats.ekf_active || particles.empty())
+  {
+    prediction(delta_t, std_pos, velocity, yaw_rate);
+    updateWeights(sensor_range, std_landmark, observations, map_landmarks);
+    return;
+  }
+  {
+    ModeTimer timer(hybrid_stats);
+    PrepareMap(map_landmarks, sensor_range, std_landmark, true);
+    if (!multiplicity.empty())
+    {
+      ExpandParticles();
+    }
+
+    // Look-ahead: coarse likelihood of the observations from the
+    //   noiseless motion of every particle
+    const vector<LandmarkObs>& obs = SelectObservations(observations);
+    const CtrvModel<double> motion(delta_t, velocity, yaw_rate);
+    aux_look.resize(num_particles);
+    ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+      for (int n=begin; n<end; n++)
+      {
+        const Particle& p = particles[n];
+        double x = p.x;
+        double y = p.y;
+        double c1, s1;
+        motion.Move(x, y, p.cos_theta, p.sin_theta, c1, s1);
+        aux_look[n] = CoarseLogLikelihood(x, y, c1, s1, obs);
+      }
+    });
+    double maxLook = -HUGE_VAL;
+    for (int n=0; n<num_particles; n++)
+    {
+      maxLook = std::max(maxLook, aux_look[n]);
+    }
+
+    // Resample on weight times look-ahead; every particle carries the
+    //   look-ahead of its parent in log_weight through resampling
+    for (int n=0; n<num_particles; n++)
+    {
+      double look = std::isfinite(maxLook) ? aux_look[n] - maxLook : 0.0;
+      particles[n].log_weight = look;
+      particles[n].weight *= exp(look);
+    }
+  }
+  resample();
+  prediction(delta_t, std_pos, velocity, yaw_rate);
+
+  // Particles injected by augmented MCL come last and were not drawn on a
+  //   look-ahead; they get the mean look-ahead of the drawn ones
+  const int drawn = num_particles - amcl_stats.injected;
+  double sumLook = 0.0;
+  aux_look.resize(num_particles);
+  for (int n=0; n<drawn; n++)
+  {
+    aux_look[n] = particles[n].log_weight;
+    sumLook += aux_look[n];
+  }
+  const double meanLook = drawn > 0 && std::isfinite(sumLook) ? sumLook / drawn : 0.0;
+  for (int n=drawn; n<num_particles; n++)
+  {
+    aux_look[n] = meanLook;
+  }
+  aux_pending = true;
+  updateWeights(sensor_range, std_landmark, observations, map_landmarks);
+}
+
+void ParticleFilter::SelectForExactWeighting(const vector<LandmarkObs>& observations,
+                                             ArenaVector<double>& inclusion) {
+  ArenaAllocator<double> alloc(frame_arena);
+  inclusion.assign(num_particles, 0.0);
+
+  // Coarse log-likelihood of every particle
+  ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+    for (int n=begin; n<end; n++)
+    {
+      const Particle& p = particles[n];
+      inclusion[n] = CoarseLogLikelihood(p.x, p.y, p.cos_theta, p.sin_theta, observations);
+    }
+  });
+  double maxLog = ParallelReduce(num_particles, workers, -HUGE_VAL,
+    [&](int begin, int end) {
+      double m = -HUGE_VAL;
+      for (int n=begin; n<end; n++)
+      {
+        m = std::max(m, inclusion[n]);
+      }
+      return m;
+    },
+    [](double a, double b) { return std::max(a, b); },
+    alloc);
+
+  // Coarse weights relative to the best particle
+  ParallelFor(num_particles, kReduceBlock, workers, [&](int block, int begin, int end) {
+    for (int n=begin; n<end; n++)
+    {
+      inclusion[n] = std::isfinite(maxLog) ? exp(inclusion[n] - maxLog) : 1.0;
+    }
+  });
+
+  // Scale c so that sum(min(1, c q)) matches the target count. The sum is
+  //   concave and piecewise linear in c, so Newton steps from below
+  //   approach the target monotonically.
+  const double target = std::max(1.0, two_stage_fraction * num_particles);
+  struct CountSlope {
+    double count;  // sum(min(1, c q))
+    double slope;  // sum of q over the particles with c q < 1
+  };
+  double c = 0.0;
+  for (int iter=0; iter<20; iter++)
+  {
+    CountSlope cs = {0.0, 0.0};
+    cs = ParallelReduce(num_particles, workers, cs,
+      [&](int begin, int end) {
+        CountSlope part = {0.0, 0.0};
+        for (int n=begin; n<end; n++)
+        {
+          double cq = c * inclusion[n];
+          part.count += std::min(1.0, cq);
+          part.slope += cq < 1.0 ? inclusion[n] : 0.0;
+        }
+        return part;
+      },
+      [](const CountSlope& a, const CountSlope& b) {
+        CountSlope sum = {a.count + b.count, a.slope + b.slope};
+        return sum;
+      },
+      ArenaAllocator<CountSlope>(frame_arena));
+    if (cs.count >= (1.0 - 1e-3) * target || cs.slope <= 0.0)
+    {
+      break;
+    }
+    c += (target - cs.count) / cs.slope;
+  }
+
+  // Draw, keeping the inclusion probability of the drawn particles
   for (int n=0; n<num_particles; n++)
-  { 
-    // Clear observations and predicted landmarks for new particle
-    observations_mapCoordinates.clear();
-    predictedLMs.clear();
- 
-    // Get observations in map coordinates
-    for (uint m=0; m<observations.size(); m++)
+  {
+    double prob = std::min(1.0, c * inclusion[n]);
+    inclusion[n] = noise_rng.Uniform() <= prob ? prob : 0.0;
+  }
+}
+
+bool ParticleFilter::EkfUpdate(double sensor_range, double std_landmark[],
+                               const vector<LandmarkObs> &observations) {
+  const HybridConfig& hc = hybrid_config;
+  const LandmarkIndex& index = landmark_index;
+
+  if (worker_scratch.empty())
+  {
+    worker_scratch.resize(1);
+  }
+  vector<int>& inRange = worker_scratch[0].landmarksInRange;
+  index.QueryRange(ekf.x[0], ekf.x[1], sensor_range, inRange);
+
+  // The predicted state, kept for re-expanding if the update is rejected
+  const PoseEkf predicted = ekf;
+
+  Particle mean;
+  mean.id = 0;
+  double nisSum = 0.0;
+  for (const auto& obs : observations)
+  {
+    // Nearest landmark to the observation under the current mean pose
+    double c = cos(ekf.x[2]);
+    double s = sin(ekf.x[2]);
+    double mx = ekf.x[0] + c * obs.x - s * obs.y;
+    double my = ekf.x[1] + s * obs.x + c * obs.y;
+    int best = -1;
+    double minDist = 9.9e50;
+    for (int idx : inRange)
     {
-      LandmarkObs obs_lm;
-      obs_lm.x = particles[n].x + cos(particles[n].theta)*observations[m].x - sin(particles[n].theta)*observations[m].y;
-      obs_lm.y = particles[n].y + sin(particles[n].theta)*observations[m].x + cos(particles[n].theta)*observations[m].y; 
-      obs_lm.id = observations[m].id;
-      observations_mapCoordinates.push_back(obs_lm);
+      double d = dist(index.x[idx], index.y[idx], mx, my);
+      if (d < minDist)
+      {
+        minDist = d;
+        best = idx;
+      }
     }
 
-    // Find nearest predicted landmarks to particles within sensor range
-    for (auto landmark : map_landmarks.landmark_list)
+    double nis = hc.nis_gate;
+    if (best >= 0)
     {
-      LandmarkObs lm;
-      lm.id = landmark.id_i;
-      lm.x = landmark.x_f;
-      lm.y = landmark.y_f;
+      nis = std::min(hc.nis_gate, ekf.Update(obs.x, obs.y, index.x[best], index.y[best], std_landmark, hc.nis_gate));
+    }
+    nisSum += nis;
+
+    mean.associations.push_back(best >= 0 ? index.id[best] : -1);
+    mean.sense_x.push_back(mx);
+    mean.sense_y.push_back(my);
+  }
+  if (!observations.empty())
+  {
+    hybrid_stats.nis_avg += hc.nis_alpha * (nisSum / observations.size() - hybrid_stats.nis_avg);
+  }
+  if (!(hybrid_stats.nis_avg <= hc.nis_threshold))
+  {
+    // Inconsistent: the particles redo the step from the prediction, so
+    //   the observations are not counted twice
+    ekf = predicted;
+    return false;
+  }
+
+  // The EKF state is the estimate, represented by a single particle
+  pose_estimate.x = ekf.x[0];
+  pose_estimate.y = ekf.x[1];
+  pose_estimate.theta = ekf.x[2];
+  memcpy(pose_estimate.cov, ekf.P, sizeof(pose_estimate.cov));
+
+  mean.x = ekf.x[0];
+  mean.y = ekf.x[1];
+  SetTheta(mean, ekf.x[2]);
+  mean.weight = 1.0;
+  mean.log_weight = 0.0;
+  particles.assign(1, mean);
+  num_particles = 1;
+
+  return true;
+}
+
+void ParticleFilter::CheckCollapse() {
+  const HybridConfig& hc = hybrid_config;
+  const PoseEstimate& est = pose_estimate;
+  if (est.cov[0][0] + est.cov[1][1] < hc.collapse_position_var &&
+      est.cov[2][2] < hc.collapse_yaw_var)
+  {
+    tight_steps++;
+  }
+  else
+  {
+    tight_steps = 0;
+  }
+  if (tight_steps < hc.collapse_steps)
+  {
+    return;
+  }
+
+  ekf.x[0] = est.x;
+  ekf.x[1] = est.y;
+  ekf.x[2] = est.theta;
+  memcpy(ekf.P, est.cov, sizeof(ekf.P));
+
+  // A single particle at the mean stands for the EKF, keeping the
+  //   associations of the best particle until the EKF's first update
+  int best = (int)(std::max_element(particles.begin(), particles.end(),
+                     [](const Particle& a, const Particle& b) { return a.weight < b.weight; }) -
+                   particles.begin());
+  Particle mean = particles[best];
+  mean.id = 0;
+  mean.x = est.x;
+  mean.y = est.y;
+  SetTheta(mean, est.theta);
+  mean.weight = 1.0;
+  mean.log_weight = 0.0;
+  particles.assign(1, mean);
+  multiplicity.clear();
+  num_particles = 1;
+
+  hybrid_stats.ekf_active = true;
+  hybrid_stats.collapses++;
+  hybrid_stats.nis_avg = 2.0;  // expected NIS of a 2D observation
+  tight_steps = 0;
+}
 
-      double d = dist(lm.x, lm.y, particles[n].x, particles[n].y); 
-      if (d < sensor_range)
+void ParticleFilter::ExpandFromEkf() {
+  const double k = hybrid_config.expand_inflation;
+
+  // Cholesky factor L of the inflated covariance, L L^T = k P
+  double L[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+  for (int r=0; r<3; r++)
+  {
+    for (int c=0; c<=r; c++)
+    {
+      double v = k * ekf.P[r][c];
+      for (int j=0; j<c; j++)
+      {
+        v -= L[r][j] * L[c][j];
+      }
+      if (r == c)
+      {
+        L[r][c] = sqrt(std::max(v, 0.0));
+      }
+      else
       {
-        predictedLMs.push_back(lm);
+        L[r][c] = L[c][c] > 0.0 ? v / L[c][c] : 0.0;
       }
     }
+  }
+
+  normal_distribution<double> unitNormal(0.0, 1.0);
+  multiplicity.clear();
+  num_particles = target_particles;
+  particles.resize(num_particles);
+  for (int n=0; n<num_particles; n++)
+  {
+    double u[3] = {unitNormal(step_gen), unitNormal(step_gen), unitNormal(step_gen)};
+    Particle& p = particles[n];
+    p.id = n;
+    p.x = ekf.x[0] + L[0][0] * u[0];
+    p.y = ekf.x[1] + L[1][0] * u[0] + L[1][1] * u[1];
+    SetTheta(p, ekf.x[2] + L[2][0] * u[0] + L[2][1] * u[1] + L[2][2] * u[2]);
+    p.weight = 1.0;
+    p.log_weight = 0.0;
+    p.associations.clear();
+    p.sense_x.clear();
+    p.sense_y.clear();
+  }
+
+  hybrid_stats.ekf_active = false;
+  hybrid_stats.expansions++;
+}
+
+void ParticleFilter::UpdateParticle(Particle& particle, double sensor_range, double std_landmark[],
+                                    const vector<LandmarkObs> &observations,
+                                    WeightScratch& scratch) {
+  if (use_likelihood_field)
+  {
+    // Weight by lookup in the likelihood field, without association
+    double logWeight = 0.0;
+    particle.sense_x.clear();
+    particle.sense_y.clear();
+    particle.associations.clear();
+    for (uint m=0; m<observations.size(); m++)
+    {
+      double x = particle.x + particle.cos_theta*observations[m].x - particle.sin_theta*observations[m].y;
+      double y = particle.y + particle.sin_theta*observations[m].x + particle.cos_theta*observations[m].y;
+      logWeight += likelihood_field.LogLikelihood(x, y);
+      particle.sense_x.push_back(x);
+      particle.sense_y.push_back(y);
+    }
+    particle.log_weight = logWeight;
+    particle.weight = exp(logWeight);
+    return;
+  }
+  if (use_pruning && !use_assignment)
+  {
+    WeightWithPruning(particle, sensor_range, std_landmark, observations, scratch);
+    return;
+  }
+
+  vector<LandmarkObs>& observations_mapCoordinates = scratch.observations_mapCoordinates;
+  vector<LandmarkObs>& predictedLMs = scratch.predictedLMs;
 
-    // Associate observations with predicted landmarks
+  // Clear observations and predicted landmarks for new particle
+  observations_mapCoordinates.clear();
+  predictedLMs.clear();
+
+  // Get observations in map coordinates
+  for (uint m=0; m<observations.size(); m++)
+  {
+    LandmarkObs obs_lm;
+    obs_lm.x = particle.x + particle.cos_theta*observations[m].x - particle.sin_theta*observations[m].y;
+    obs_lm.y = particle.y + particle.sin_theta*observations[m].x + particle.cos_theta*observations[m].y; 
+    obs_lm.id = observations[m].id;
+    observations_mapCoordinates.push_back(obs_lm);
+  }
+
+  // Find predicted landmarks within sensor range of the particle
+  landmark_index.QueryRange(particle.x, particle.y, sensor_range, scratch.landmarksInRange);
+  for (int idx : scratch.landmarksInRange)
+  {
+    LandmarkObs lm;
+    lm.id = landmark_index.id[idx];
+    lm.x = landmark_index.x[idx];
+    lm.y = landmark_index.y[idx];
+    predictedLMs.push_back(lm);
+  }
+
+  // Associate observations with predicted landmarks
+  double assignmentLogWeight = 0.0;
+  if (use_assignment)
+  {
+    assignmentLogWeight = AssociateByAssignment(std_landmark, predictedLMs,
+                                                observations_mapCoordinates, scratch);
+  }
+  else if (use_association_cache)
+  {
+    AssociateWithCache(particle, sensor_range, predictedLMs, observations_mapCoordinates, scratch.stats);
+  }
+  else
+  {
     dataAssociation(predictedLMs, observations_mapCoordinates);
+  }
+
+  // Copy data from observations into particle
+  particle.sense_x.clear();
+  particle.sense_y.clear();
+  particle.associations.clear();
+  for (auto obs : observations_mapCoordinates)
+  {
+    particle.sense_x.push_back(obs.x);
+    particle.sense_y.push_back(obs.y);
+    particle.associations.push_back(obs.id);    
+  }    
+  
+  if (use_assignment)
+  {
+    particle.log_weight = assignmentLogWeight;
+    particle.weight = exp(assignmentLogWeight);
+    return;
+  }
+  CalculateParticleWeight(particle, std_landmark, predictedLMs);
+}
+
+void ParticleFilter::WeightWithPruning(Particle& particle, double sensor_range, double std_landmark[],
+                                       const vector<LandmarkObs> &observations,
+                                       WeightScratch& scratch) {
+  // Weight against the best complete particle so far. The particle stops
+  //   as soon as even perfect matches of its remaining observations could
+  //   not bring it within the margin of the best, before the work on them.
+  std::atomic<double>& best = *scratch.best_log_weight;
+  double seen = best.load(std::memory_order_relaxed);
+  const double pruneBelow = seen - prune_margin;
+  const double maxObsLogLik = -log(2 * M_PI * std_landmark[0] * std_landmark[1]);
+  const size_t numObs = observations.size();
+
+  vector<LandmarkObs>& associated = scratch.observations_mapCoordinates;
+  vector<LandmarkObs>& predictedLMs = scratch.predictedLMs;
+  associated.clear();
+  predictedLMs.clear();
+
+  double logWeight = 0.0;
+  bool pruned = numObs * maxObsLogLik < pruneBelow;
+  if (!pruned)
+  {
+    landmark_index.QueryRange(particle.x, particle.y, sensor_range, scratch.landmarksInRange);
+    for (int idx : scratch.landmarksInRange)
+    {
+      LandmarkObs lm;
+      lm.id = landmark_index.id[idx];
+      lm.x = landmark_index.x[idx];
+      lm.y = landmark_index.y[idx];
+      predictedLMs.push_back(lm);
+    }
+  }
 
-    // Copy data from observations into particle
-    particles[n].sense_x.clear();
-    particles[n].sense_y.clear();
-    particles[n].associations.clear();
-    for (auto obs : observations_mapCoordinates)
+  // Transform, associate and weight one observation at a time. The cache
+  //   reads the particle's associations of the last step, so they are
+  //   replaced only after the loop.
+  for (uint m=0; m<numObs && !pruned; m++)
+  {
+    if (logWeight + (numObs - m) * maxObsLogLik < pruneBelow)
+    {
+      pruned = true;
+      break;
+    }
+    LandmarkObs obs;
+    obs.x = particle.x + particle.cos_theta*observations[m].x - particle.sin_theta*observations[m].y;
+    obs.y = particle.y + particle.sin_theta*observations[m].x + particle.cos_theta*observations[m].y;
+    if (use_association_cache)
+    {
+      obs.id = AssociateObservation(particle, m, sensor_range, predictedLMs, obs, scratch.stats);
+    }
+    else
     {
-      particles[n].sense_x.push_back(obs.x);
-      particles[n].sense_y.push_back(obs.y);
-      particles[n].associations.push_back(obs.id);    
-    }    
-    
-    CalculateParticleWeight(particles[n], std_landmark, predictedLMs); 
+      obs.id = NearestLandmarkId(predictedLMs, obs.x, obs.y);
+    }
+    LandmarkObs match = PredictedById(predictedLMs, obs.id);
+    logWeight += log_multiv_prob(std_landmark[0], std_landmark[1], obs.x, obs.y, match.x, match.y);
+    associated.push_back(obs);
   }
 
-  // Normalize weights
-  double sum = 0.0;
-  for (int n = 0; n < num_particles; n++)
+  // A pruned particle keeps the associations it got to
+  particle.sense_x.clear();
+  particle.sense_y.clear();
+  particle.associations.clear();
+  for (const auto& obs : associated)
   {
-    sum += particles[n].weight;
+    particle.sense_x.push_back(obs.x);
+    particle.sense_y.push_back(obs.y);
+    particle.associations.push_back(obs.id);
   }
-  if (sum > 1e-5)  // avoid divide by 0
+
+  if (pruned)
+  {
+    particle.log_weight = -HUGE_VAL;
+    particle.weight = 0.0;
+    scratch.stats.pruned++;
+    return;
+  }
+  particle.log_weight = logWeight;
+  particle.weight = exp(logWeight);
+
+  // Raise the shared best
+  while (particle.log_weight > seen &&
+         !best.compare_exchange_weak(seen, particle.log_weight, std::memory_order_relaxed))
+  {
+  }
+}
+
+ParticleFilter::WeightMoments ParticleFilter::ReduceWeights() const {
+  WeightMoments identity;
+  memset(&identity, 0, sizeof(identity));
+  identity.max_weight = -1.0;
+  identity.max_index = -1;
+  if (particles.empty())
+  {
+    return identity;
+  }
+
+  // Moments are taken relative to the first particle to avoid cancellation
+  const double refX = particles[0].x;
+  const double refY = particles[0].y;
+  const double refTheta = particles[0].theta;
+
+  WeightMoments total = ParallelReduce((int)particles.size(), workers, identity,
+    [&](int begin, int end) {
+      WeightMoments p = identity;
+      for (int n=begin; n<end; n++)
+      {
+        const Particle& pt = particles[n];
+        // Copies of an encoded parent count once each
+        double copies = multiplicity.empty() ? 1.0 : multiplicity[n];
+        double w = pt.weight * copies;
+        double dx = pt.x - refX;
+        double dy = pt.y - refY;
+        double dt = pt.theta - refTheta;
+        dt -= 2.0 * M_PI * floor((dt + M_PI) / (2.0 * M_PI));  // wrap to [-pi, pi)
+
+        p.sum += w;
+        p.sum_sq += w * pt.weight;
+        p.sum_x += w * dx;
+        p.sum_y += w * dy;
+        p.sum_t += w * dt;
+        p.sum_cos += w * pt.cos_theta;
+        p.sum_sin += w * pt.sin_theta;
+        p.sum_xx += w * dx * dx;
+        p.sum_xy += w * dx * dy;
+        p.sum_xt += w * dx * dt;
+        p.sum_yy += w * dy * dy;
+        p.sum_yt += w * dy * dt;
+        p.sum_tt += w * dt * dt;
+        if (pt.weight > p.max_weight)
+        {
+          p.max_weight = pt.weight;
+          p.max_index = n;
+        }
+      }
+      return p;
+    },
+    [](const WeightMoments& a, const WeightMoments& b) {
+      WeightMoments p;
+      p.sum = a.sum + b.sum;
+      p.sum_sq = a.sum_sq + b.sum_sq;
+      p.sum_x = a.sum_x + b.sum_x;
+      p.sum_y = a.sum_y + b.sum_y;
+      p.sum_t = a.sum_t + b.sum_t;
+      p.sum_cos = a.sum_cos + b.sum_cos;
+      p.sum_sin = a.sum_sin + b.sum_sin;
+      p.sum_xx = a.sum_xx + b.sum_xx;
+      p.sum_xy = a.sum_xy + b.sum_xy;
+      p.sum_xt = a.sum_xt + b.sum_xt;
+      p.sum_yy = a.sum_yy + b.sum_yy;
+      p.sum_yt = a.sum_yt + b.sum_yt;
+      p.sum_tt = a.sum_tt + b.sum_tt;
+      // 'a' covers lower indices, so it wins ties
+      p.max_weight = b.max_weight > a.max_weight ? b.max_weight : a.max_weight;
+      p.max_index = b.max_weight > a.max_weight ? b.max_index : a.max_index;
+      return p;
+    },
+    ArenaAllocator<WeightMoments>(frame_arena));
+
+  total.ref_x = refX;
+  total.ref_y = refY;
+  total.ref_theta = refTheta;
+  return total;
+}
+
+PoseEstimate ParticleFilter::EstimateFromMoments(const WeightMoments& m) {
+  PoseEstimate est;
+  memset(&est, 0, sizeof(est));
+  if (m.sum <= 0.0)
+  {
+    return est;
+  }
+
+  double mx = m.sum_x / m.sum;
+  double my = m.sum_y / m.sum;
+  double mt = m.sum_t / m.sum;
+  est.x = m.ref_x + mx;
+  est.y = m.ref_y + my;
+  est.theta = atan2(m.sum_sin, m.sum_cos);
+
+  // Central moments from the moments about the reference pose
+  est.cov[0][0] = m.sum_xx / m.sum - mx * mx;
+  est.cov[0][1] = m.sum_xy / m.sum - mx * my;
+  est.cov[0][2] = m.sum_xt / m.sum - mx * mt;
+  est.cov[1][1] = m.sum_yy / m.sum - my * my;
+  est.cov[1][2] = m.sum_yt / m.sum - my * mt;
+  est.cov[2][2] = m.sum_tt / m.sum - mt * mt;
+  est.cov[1][0] = est.cov[0][1];
+  est.cov[2][0] = est.cov[0][2];
+  est.cov[2][1] = est.cov[1][2];
+  return est;
+}
+
+WeightSummary ParticleFilter::SummarizeWeights() const {
+  WeightMoments m = ReduceWeights();
+
+  WeightSummary summary;
+  summary.weight_sum = m.sum;
+  summary.ess = m.sum_sq > 0.0 ? m.sum * m.sum / m.sum_sq : 0.0;
+  summary.max_weight = m.max_weight;
+  summary.best_index = m.max_index;
+  summary.mean_x = m.sum > 0.0 ? m.ref_x + m.sum_x / m.sum : 0.0;
+  summary.mean_y = m.sum > 0.0 ? m.ref_y + m.sum_y / m.sum : 0.0;
+  return summary;
+}
+
+vector<PoseMode> ParticleFilter::FindModes(int max_modes, double cell_size) {
+  const double invCell = 1.0 / cell_size;
+
+  // Accumulate particles per grid cell
+  mode_grid.Reset(particles.size());
+  mode_cells.clear();
+  for (uint n=0; n<particles.size(); n++)
+  {
+    const Particle& p = particles[n];
+    int copies = multiplicity.empty() ? 1 : multiplicity[n];
+    int cx = GridHash::CellCoord(p.x, invCell);
+    int cy = GridHash::CellCoord(p.y, invCell);
+    int slot = mode_grid.Insert(GridHash::CellKey(cx, cy));
+    if (slot == (int)mode_cells.size())
+    {
+      ModeCell cell = {cx, cy, 0, 0.0, 0.0, 0.0, 0.0, 0.0, slot};
+      mode_cells.push_back(cell);
+    }
+    ModeCell& cell = mode_cells[slot];
+    double w = p.weight * copies;
+    cell.count += copies;
+    cell.weight += w;
+    cell.sum_x += w * p.x;
+    cell.sum_y += w * p.y;
+    cell.sum_cos += w * p.cos_theta;
+    cell.sum_sin += w * p.sin_theta;
+  }
+  const int numCells = (int)mode_cells.size();
+
+  // Link every cell to the heaviest cell of its 3x3 neighbourhood, lowest
+  //   slot on ties, so links always climb and cannot form cycles
+  for (int n=0; n<numCells; n++)
   {
-    for (int n = 0; n < num_particles; n++)
+    ModeCell& cell = mode_cells[n];
+    for (int dx=-1; dx<=1; dx++)
     {
-      particles[n].weight = particles[n].weight / sum;
+      for (int dy=-1; dy<=1; dy++)
+      {
+        int slot = mode_grid.Find(GridHash::CellKey(cell.cx + dx, cell.cy + dy));
+        if (slot < 0)
+        {
+          continue;
+        }
+        const ModeCell& best = mode_cells[cell.parent];
+        if (mode_cells[slot].weight > best.weight ||
+            (mode_cells[slot].weight == best.weight && slot < cell.parent))
+        {
+          cell.parent = slot;
+        }
+      }
     }
   }
+
+  // Follow the links to the local maximum, compressing the path, and
+  //   collect the cell sums at that root
+  mode_sums.assign(numCells, ModeCell());
+  for (int n=0; n<numCells; n++)
+  {
+    int root = n;
+    while (mode_cells[root].parent != root)
+    {
+      root = mode_cells[root].parent;
+    }
+    for (int c = n; mode_cells[c].parent != root && c != root; )
+    {
+      int next = mode_cells[c].parent;
+      mode_cells[c].parent = root;
+      c = next;
+    }
+
+    const ModeCell& cell = mode_cells[n];
+    ModeCell& sum = mode_sums[root];
+    sum.count += cell.count;
+    sum.weight += cell.weight;
+    sum.sum_x += cell.sum_x;
+    sum.sum_y += cell.sum_y;
+    sum.sum_cos += cell.sum_cos;
+    sum.sum_sin += cell.sum_sin;
+  }
+
+  vector<PoseMode> modes;
+  for (int n=0; n<numCells; n++)
+  {
+    const ModeCell& sum = mode_sums[n];
+    if (sum.count == 0 || sum.weight <= 0.0)
+    {
+      continue;
+    }
+    PoseMode m;
+    m.x = sum.sum_x / sum.weight;
+    m.y = sum.sum_y / sum.weight;
+    m.theta = atan2(sum.sum_sin, sum.sum_cos);
+    m.weight = sum.weight;
+    m.num_particles = sum.count;
+    modes.push_back(m);
+  }
+
+  // Heaviest modes first
+  int numModes = std::min((int)modes.size(), std::max(0, max_modes));
+  std::partial_sort(modes.begin(), modes.begin() + numModes, modes.end(),
+                    [](const PoseMode& a, const PoseMode& b) { return a.weight > b.weight; });
+  modes.resize(numModes);
+  return modes;
 }
 
 void ParticleFilter::resample() {
@@ -240,30 +1687,220 @@ void ParticleFilter::resample() {
    * NOTE: You may find std::discrete_distribution helpful here.
    *   http://en.cppreference.com/w/cpp/numeric/random/discrete_distribution
    */
-  std::vector<Particle> newParticles;
-  std::default_random_engine gen;
-  vector<double> weights;
-  // Generate vector with all weights
-  for (int n=0; n<num_particles; n++)
+  ModeTimer timer(hybrid_stats);
+  if (hybrid_stats.ekf_active)
+  {
+    return;  // nothing to resample while the EKF runs
+  }
+  if (!multiplicity.empty())
   {
-    weights.push_back(particles[n].weight);
+    ExpandParticles();  // resampled twice without a prediction
   }
 
-  // Use discrete_distribution to sample with probability proportional to their weight.  
-  std::discrete_distribution<int> particleDistr(weights.begin(),weights.end());
+  ArenaAllocator<Particle> alloc(frame_arena);
+  const int numSources = num_particles;
 
-  // Generate vector with new particles
-  for (int n=0; n<num_particles; n++)
+  // Sample with probability proportional to the weights, with the
+  //   cumulative table in the frame arena
+  ArenaVector<double> cumulative(alloc);
+  CumulativeSampler<ArenaVector<double> > particleDistr(cumulative, numSources,
+    [&](int n) { return particles[n].weight; });
+
+  // Draw one particle, replaced by a random one for kidnap recovery. Only
+  //   the source index is recorded; injected particles are kept aside.
+  const double injectProb = use_augmented_mcl ? amcl_stats.injection_prob : 0.0;
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  int injected = 0;
+  ArenaVector<int> copies(numSources, 0, alloc);
+  ArenaVector<Particle> injectedParticles(alloc);
+  auto draw = [&]() -> const Particle& {
+    if (injectProb > 0.0 && unit(step_gen) < injectProb)
+    {
+      injected++;
+      injectedParticles.push_back(RandomParticle(step_gen));
+      return injectedParticles.back();
+    }
+    int idx = particleDistr(resample_gen);
+    copies[idx]++;
+    return particles[idx];
+  };
+
+  // Under a step deadline draw no more particles than the step reached,
+  //   growing back by a quarter once none were shed
+  int maxDraw = std::numeric_limits<int>::max();
+  if (step_budget_ms > 0.0)
+  {
+    const int reached = deadline_stats.reached;
+    maxDraw = std::max(1, deadline_stats.shed > 0 ? reached : reached + std::max(1, reached / 4));
+  }
+
+  if (use_kld_sampling)
+  {
+    // Draw until the KL bound over the occupied pose bins is met
+    const KldConfig& kc = kld_config;
+    const int maxParticles = std::min(kc.max_particles, maxDraw);
+    const double invXY = 1.0 / kc.bin_size_xy;
+    const double invTheta = 1.0 / kc.bin_size_theta;
+    kld_bins.Reset(std::min(num_particles, maxParticles));
+
+    int occupiedBins = 0;
+    double bound = kc.min_particles;
+    int n = 0;
+    while (n < maxParticles && (n < kc.min_particles || n < bound))
+    {
+      const Particle& p = draw();  // resamble
+      n++;
+
+      double theta = p.theta - 2.0 * M_PI * floor((p.theta + M_PI) / (2.0 * M_PI));
+      uint64_t key = GridHash::CellKey(GridHash::CellCoord(p.x, invXY),
+                                       GridHash::CellCoord(p.y, invXY),
+                                       GridHash::CellCoord(theta, invTheta));
+      if (kld_bins.Insert(key) == occupiedBins)
+      {
+        occupiedBins++;
+        bound = KldBound(occupiedBins, kc.epsilon, kc.z);
+      }
+    }
+    num_particles = n;
+  }
+  else
+  {
+    // After global initialization halve the particle set each step once the
+    //   posterior has collapsed, until the converged size is reached
+    if (converged_particles > 0 && target_particles > converged_particles &&
+        pose_estimate.cov[0][0] + pose_estimate.cov[1][1] < kConvergedPositionVar)
+    {
+      target_particles = std::max(converged_particles, target_particles / 2);
+    }
+    num_particles = std::min(target_particles, maxDraw);
+
+    // Draw the new particles
+    for (int n=0; n<num_particles; n++)
+    {
+      draw();  // resamble
+    }
+  }
+
+  amcl_stats.injected = injected;
+
+  // Write the new set into the back buffer in one pass over the sources,
+  //   replicating each drawn source by its copy count, or once with its
+  //   count when encoding multiplicities, then swap buffers. The drawn set
+  //   is an unweighted sample, every particle gets weight 1/N.
+  const double uniformWeight = 1.0 / num_particles;
+  int numStored = num_particles;
+  multiplicity.clear();
+  if (use_multiplicity)
+  {
+    numStored = (int)injectedParticles.size();
+    for (int i=0; i<numSources; i++)
+    {
+      numStored += copies[i] > 0 ? 1 : 0;
+    }
+    multiplicity.reserve(numStored);
+  }
+  back_particles.resize(numStored);
+  int out = 0;
+  auto emit = [&](const Particle& p, int count) {
+    if (use_multiplicity)
+    {
+      back_particles[out] = p;
+      back_particles[out++].weight = uniformWeight;
+      multiplicity.push_back(count);
+      return;
+    }
+    for (int c=0; c<count; c++)
+    {
+      back_particles[out] = p;
+      back_particles[out++].weight = uniformWeight;
+    }
+  };
+  if (use_spatial_order)
+  {
+    // Visit the drawn sources along a Hilbert curve over the landmark
+    //   bounding box; positions outside it are clamped to the border
+    const LandmarkIndex& index = landmark_index;
+    const double scaleX = 65535.0 / std::max(index.max_x - index.min_x, 1e-9);
+    const double scaleY = 65535.0 / std::max(index.max_y - index.min_y, 1e-9);
+    ArenaVector<uint64_t> order(alloc);
+    order.reserve(numSources);
+    for (int i=0; i<numSources; i++)
+    {
+      if (copies[i] > 0)
+      {
+        double gx = std::min(std::max((particles[i].x - index.min_x) * scaleX, 0.0), 65535.0);
+        double gy = std::min(std::max((particles[i].y - index.min_y) * scaleY, 0.0), 65535.0);
+        order.push_back(((uint64_t)GridHash::HilbertKey((uint32_t)gx, (uint32_t)gy) << 32) | (uint32_t)i);
+      }
+    }
+    std::sort(order.begin(), order.end());
+    for (uint64_t key : order)
+    {
+      int i = (int)(key & 0xFFFFFFFFu);
+      emit(particles[i], copies[i]);
+    }
+  }
+  else
   {
-    int pIdx = particleDistr(gen);
-    newParticles.push_back(particles[pIdx]);  // resamble
+    for (int i=0; i<numSources; i++)
+    {
+      if (copies[i] > 0)
+      {
+        emit(particles[i], copies[i]);
+      }
+    }
   }
+  for (const auto& p : injectedParticles)
+  {
+    emit(p, 1);
+  }
+  particles.swap(back_particles);
+
+  cumulative.clear();
+  copies.clear();
+  injectedParticles.clear();
+  frame_arena.Reset();
 
-  // overwrite old particles
-  particles = newParticles;
+  if (deadline_pending)
+  {
+    // Time of the step and of its normalization and resampling per source
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point now = Clock::now();
+    const double tailMs = std::chrono::duration<double, std::milli>(now - step_start).count() -
+                          deadline_stats.used_ms;
+    deadline_stats.step_ms = std::chrono::duration<double, std::milli>(now - step_start).count();
+    tail_ns_estimate = (long long)(tailMs * 1e6 / std::max(numSources, 1));
+    deadline_pending = false;
+  }
 
 }
 
+Particle ParticleFilter::RandomParticle(std::default_random_engine& gen) const {
+  const LandmarkIndex& index = landmark_index;
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  Particle p;
+  p.id = 0;
+  p.weight = 1.0;
+  p.log_weight = 0.0;
+  SetTheta(p, -M_PI + 2.0 * M_PI * unit(gen));
+
+  if (!last_observations.empty() && index.size() > 0)
+  {
+    // Vehicle pose under which the observation lands exactly on the landmark
+    const LandmarkObs& obs = last_observations[(size_t)(unit(gen) * last_observations.size()) % last_observations.size()];
+    int lm = (int)(unit(gen) * index.size()) % (int)index.size();
+    p.x = index.x[lm] - (p.cos_theta * obs.x - p.sin_theta * obs.y);
+    p.y = index.y[lm] - (p.sin_theta * obs.x + p.cos_theta * obs.y);
+  }
+  else
+  {
+    p.x = index.min_x + (index.max_x - index.min_x) * unit(gen);
+    p.y = index.min_y + (index.max_y - index.min_y) * unit(gen);
+  }
+  return p;
+}
+
 void ParticleFilter::SetAssociations(Particle& particle, 
                                      const vector<int>& associations, 
                                      const vector<double>& sense_x, 
@@ -273,13 +1910,13 @@ void ParticleFilter::SetAssociations(Particle& particle,
   // associations: The landmark id that goes along with each listed association
   // sense_x: the associations x mapping already converted to world coordinates
   // sense_y: the associations y mapping already converted to world coordinates
-  particle.associations= associations;
-  particle.sense_x = sense_x;
-  particle.sense_y = sense_y;
+  particle.associations.assign(associations.begin(), associations.end());
+  particle.sense_x.assign(sense_x.begin(), sense_x.end());
+  particle.sense_y.assign(sense_y.begin(), sense_y.end());
 }
 
 string ParticleFilter::getAssociations(Particle best) {
-  vector<int> v = best.associations;
+  vector<int> v(best.associations.begin(), best.associations.end());
   std::stringstream ss;
   copy(v.begin(), v.end(), std::ostream_iterator<int>(ss, " "));
   string s = ss.str();
@@ -291,9 +1928,9 @@ string ParticleFilter::getSenseCoord(Particle best, string coord) {
   vector<double> v;
 
   if (coord == "X") {
-    v = best.sense_x;
+    v.assign(best.sense_x.begin(), best.sense_x.end());
   } else {
-    v = best.sense_y;
+    v.assign(best.sense_y.begin(), best.sense_y.end());
   }
 
   std::stringstream ss;
@@ -321,9 +1958,13 @@ string ParticleFilter::getSenseCoord(Particle best, string coord) {
    */
   void ParticleFilter::PrintAllParticlesData(std::fstream& fileStream)
   {
-    for (int n=0; n<num_particles; n++)
+    for (uint n=0; n<particles.size(); n++)
     {
-      PrintParticleData(particles[n], fileStream);
+      int copies = multiplicity.empty() ? 1 : multiplicity[n];
+      for (int c=0; c<copies; c++)
+      {
+        PrintParticleData(particles[n], fileStream);
+      }
     }
     fileStream << "=======================================================\n";
     fileStream.flush();
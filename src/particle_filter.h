@@ -9,21 +9,157 @@
 #ifndef PARTICLE_FILTER_H_
 #define PARTICLE_FILTER_H_
 
+#include <atomic>
+#include <chrono>
+#include <random>
 #include <string>
 #include <vector>
+#include "assignment.h"
+#include "fast_random.h"
+#include "frame_arena.h"
 #include "helper_functions.h"
+#include "inline_vector.h"
+#include "landmark_index.h"
+#include "likelihood_field.h"
+#include "parallel.h"
+#include "pose_ekf.h"
+#include "spatial_hash.h"
 #include <iostream>
 #include <fstream>
 
+/**
+ * Association and weighting counters of one updateWeights() call.
+ */
+struct AssociationStats {
+  long long lookups;     // Observations associated
+  long long gate_hits;   // Resolved by the cached landmark alone
+  long long local_hits;  // Resolved by the local neighbour search
+  long long assignment_solves;  // Particles whose gated matches conflicted
+  double assignment_ms;         // Time spent in the assignment solver [ms]
+  long long pruned;             // Particles whose weighting stopped early
+  long long coarse_skipped;     // Particles not drawn for exact weighting
+};
+
+/**
+ * Reduction over the particle weights, computed with thread count
+ *   independent (bit-identical) summation.
+ */
+struct WeightSummary {
+  double weight_sum;   // Sum of the weights
+  double ess;          // Effective sample size, sum(w)^2 / sum(w^2)
+  double max_weight;   // Highest weight
+  int best_index;      // Index of the first particle with the highest weight
+  double mean_x;       // Weighted mean x position [m]
+  double mean_y;       // Weighted mean y position [m]
+};
+
+/**
+ * Posterior pose estimate of the particle cloud.
+ */
+struct PoseEstimate {
+  double x;           // Weighted mean x position [m]
+  double y;           // Weighted mean y position [m]
+  double theta;       // Weighted circular mean yaw [rad]
+  double cov[3][3];   // Weighted covariance of (x, y, theta)
+};
+
+/**
+ * One mode of the particle cloud, found by grid clustering.
+ */
+struct PoseMode {
+  double x;           // Weighted mean x position [m]
+  double y;           // Weighted mean y position [m]
+  double theta;       // Weighted circular mean yaw [rad]
+  double weight;      // Total weight of the particles in the mode
+  int num_particles;  // Number of particles in the mode
+};
+
+/**
+ * Settings of KLD-sampling, which adapts the particle count in resample()
+ *   to the number of occupied (x, y, yaw) histogram bins.
+ */
+struct KldConfig {
+  KldConfig() : min_particles(100), max_particles(100000), epsilon(0.05),
+                z(2.33), bin_size_xy(0.5), bin_size_theta(0.175) {}
+
+  int min_particles;      // Lower limit of the particle count
+  int max_particles;      // Upper limit of the particle count
+  double epsilon;         // Bound on the KL divergence to the true posterior
+  double z;               // Upper standard normal quantile of 1 - delta
+  double bin_size_xy;     // Histogram bin size in x and y [m]
+  double bin_size_theta;  // Histogram bin size in yaw [rad]
+};
+
+/**
+ * Progress of the last updateWeights() call under a step deadline.
+ */
+struct DeadlineStats {
+  int reached;    // Particles weighted before the deadline
+  int shed;       // Particles dropped from this step (weight 0)
+  double used_ms; // Time from the start of the step to the end of weighting
+  double step_ms; // Time from the start of the step to the end of resample()
+};
+
+/**
+ * Augmented MCL state: short and long term averages of the measurement
+ *   likelihood, and the random particle injection they trigger.
+ */
+struct AugmentedMclStats {
+  double log_w_slow;         // Log of the long term average likelihood
+  double log_w_fast;         // Log of the short term average likelihood
+  double injection_prob;     // Probability of injecting a random particle
+  int injected;              // Random particles injected by the last resample
+};
+
+/**
+ * Settings of the hybrid EKF / particle filter mode.
+ */
+struct HybridConfig {
+  HybridConfig() : collapse_position_var(0.05), collapse_yaw_var(1e-4),
+                   collapse_steps(10), nis_threshold(5.0), nis_alpha(0.2),
+                   nis_gate(13.8), expand_inflation(4.0) {}
+
+  double collapse_position_var;  // Max x + y variance to collapse [m^2]
+  double collapse_yaw_var;       // Max yaw variance to collapse [rad^2]
+  int collapse_steps;            // Consecutive tight steps before collapsing
+  double nis_threshold;          // Average NIS per observation to re-expand
+  double nis_alpha;              // Smoothing factor of the average NIS
+  double nis_gate;               // NIS above which an observation is an outlier
+  double expand_inflation;       // Covariance scale when re-expanding
+};
+
+/**
+ * Mode and time spent per mode of the hybrid EKF / particle filter.
+ */
+struct HybridStats {
+  bool ekf_active;   // True while the EKF replaces the particles
+  int pf_steps;      // Updates done by the particle filter
+  int ekf_steps;     // Updates done by the EKF
+  double pf_ms;      // Time spent in particle filter mode [ms]
+  double ekf_ms;     // Time spent in EKF mode [ms]
+  int collapses;     // Switches from particles to EKF
+  int expansions;    // Switches from EKF back to particles
+  double nis_avg;    // Smoothed NIS per observation of the EKF
+};
+
+// Observations whose associations a particle stores inline. More spill to a
+//   heap buffer of the particle. Override with -DPF_INLINE_OBSERVATIONS=N.
+#ifndef PF_INLINE_OBSERVATIONS
+#define PF_INLINE_OBSERVATIONS 16
+#endif
+
 struct Particle {
   int id;
   double x;
   double y;
   double theta;
+  double cos_theta;   // cos(theta), kept in step with theta
+  double sin_theta;   // sin(theta), kept in step with theta
   double weight;
-  std::vector<int> associations;
-  std::vector<double> sense_x;
-  std::vector<double> sense_y;
+  double log_weight;  // Log likelihood of the last update, before normalization
+  InlineVector<int, PF_INLINE_OBSERVATIONS> associations;
+  InlineVector<double, PF_INLINE_OBSERVATIONS> sense_x;
+  InlineVector<double, PF_INLINE_OBSERVATIONS> sense_y;
 };
 
 
@@ -31,7 +167,23 @@ class ParticleFilter {
  public:
   // Constructor
   // @param num_particles Number of particles
-  ParticleFilter() : num_particles(0), is_initialized(false) {}
+  ParticleFilter() : num_particles(0), is_initialized(false), num_threads(1),
+                     converged_particles(0), init_particles(100), target_particles(0),
+                     step_budget_ms(0.0), step_started(false), deadline_stats(),
+                     block_ns_estimate(0), tail_ns_estimate(0), deadline_pending(false),
+                     use_augmented_mcl(false), amcl_alpha_slow(0.001),
+                     amcl_alpha_fast(0.1), amcl_stats(),
+                     use_hybrid_ekf(false), hybrid_stats(), tight_steps(0),
+                     use_kld_sampling(false),
+                     pose_estimate(), use_likelihood_field(false),
+                     likelihood_field_stale(true), field_resolution(0.1),
+                     field_max_bytes(64 * 1024 * 1024), use_association_cache(true),
+                     assoc_stats(), use_assignment(false), assignment_gate(9.21),
+                     use_pruning(false), prune_margin(20.0),
+                     observation_limit(0), use_spatial_order(false),
+                     use_multiplicity(false), aux_pending(false),
+                     use_two_stage(false), two_stage_fraction(0.1),
+                     coarse_field_stale(true), coarse_field_resolution(1.0) {}
 
   // Destructor
   ~ParticleFilter() {}
@@ -47,6 +199,23 @@ class ParticleFilter {
    */
   void init(double x, double y, double theta, double std[]);
 
+  /**
+   * InitGlobal Initializes the filter for global localization, without a
+   *   position fix. Particles are spread uniformly over the bounding box of
+   *   the map landmarks with uniform yaw. After each resampling the
+   *   particle count shrinks towards 'converged_particles' once the
+   *   posterior has collapsed.
+   * @param map_landmarks Map class containing map landmarks
+   * @param sensor_range Range [m] of sensor
+   * @param initial_particles Number of particles to start with
+   * @param converged_particles Number of particles once converged
+   * @param density_weighted Sample positions proportional to
+   *   (1 + landmarks within sensor range) instead of uniformly
+   */
+  void InitGlobal(const Map &map_landmarks, double sensor_range,
+                  int initial_particles, int converged_particles,
+                  bool density_weighted);
+
   /**
    * prediction Predicts the state for the next time step
    *   using the process model.
@@ -65,7 +234,7 @@ class ParticleFilter {
    * @param predicted Vector of predicted landmark observations
    * @param observations Vector of landmark observations
    */
-  void dataAssociation(std::vector<LandmarkObs> predicted, 
+  void dataAssociation(const std::vector<LandmarkObs>& predicted, 
                        std::vector<LandmarkObs>& observations);
   
   /**
@@ -83,16 +252,360 @@ class ParticleFilter {
   
   /**
    * resample Resamples from the updated set of particles to form
-   *   the new set of particles.
+   *   the new set of particles, each with weight 1/N. Weighted summaries
+   *   (SummarizeWeights(), FindModes()) describe the posterior only
+   *   between updateWeights() and resample().
    */
   void resample();
 
+  /**
+   * AuxiliaryStep One step of the auxiliary particle filter, replacing
+   *   prediction(), updateWeights() and resample(). Every particle is first
+   *   scored by the coarse likelihood field (see SetTwoStageWeighting) of
+   *   the new observations at its noiseless predicted pose. The set is
+   *   resampled on weight times that look-ahead, so particles the
+   *   observations are about to rule out are not propagated, then
+   *   predicted and weighted by the exact likelihood divided by the
+   *   look-ahead of their parent. The particles are left weighted.
+   * @param delta_t, std_pos[], velocity, yaw_rate As for prediction()
+   * @param sensor_range, std_landmark[], observations, map_landmarks As for
+   *   updateWeights()
+   */
+  void AuxiliaryStep(double delta_t, double std_pos[], double velocity, double yaw_rate,
+                     double sensor_range, double std_landmark[],
+                     const std::vector<LandmarkObs> &observations,
+                     const Map &map_landmarks);
+
+  /**
+   * Prepare a step whose prediction and likelihood field weighting are
+   *   computed outside the filter (see FleetEngine). An encoded set is
+   *   expanded so 'particles' holds every particle. Returns the observations
+   *   updateWeights() would weight with, i.e. those kept by the observation
+   *   limit, valid until the next step. Returns NULL if the external step
+   *   would differ from the filter's own: not initialized, in EKF mode, not
+   *   weighting by a likelihood field of the given spacing and memory
+   *   bound, or with a step deadline or two-stage weighting. Use
+   *   prediction() and updateWeights() then.
+   * @param observations Observations of the step (vehicle coordinates)
+   * @param field_resolution, field_max_bytes Settings of the external field
+   */
+  const std::vector<LandmarkObs>* BeginExternalStep(const std::vector<LandmarkObs>& observations,
+                                                    double field_resolution, size_t field_max_bytes);
+
+  /**
+   * Finish an external step: 'particles' hold the moved poses and their
+   *   log_weight and weight. Normalizes the weights and updates the pose
+   *   estimate and the augmented MCL and hybrid EKF state as
+   *   updateWeights() does.
+   * @param observations The observations the particles were weighted with,
+   *   as returned by BeginExternalStep()
+   * @param external_ms Time of the external prediction and weighting
+   *   attributed to this filter [ms], added to HybridStats::pf_ms
+   */
+  void FinishExternalUpdate(const std::vector<LandmarkObs>& observations,
+                            double external_ms);
+
   /**
    *  Calculate a single particle weight from observed measurements in 'particle' and 
    * predicted landmarks from map. All is in map coordinates. 
    */
   void CalculateParticleWeight(Particle& particle, double std_landmark[], const std::vector<LandmarkObs> &predictedLandMarks); 
 
+  /**
+   * Find the heaviest modes of the particle cloud in O(N). Particles are
+   *   hashed into grid cells, every cell is linked to the heaviest cell in
+   *   its 3x3 neighbourhood, and the cells draining into the same local
+   *   maximum form one mode.
+   * @param max_modes Maximum number of modes returned, heaviest first
+   * @param cell_size Side length of a clustering cell [m]
+   */
+  std::vector<PoseMode> FindModes(int max_modes, double cell_size = 2.0);
+
+  /**
+   * Set the number of particles created by init().
+   */
+  void SetNumParticles(int particles) {
+    init_particles = particles;
+  }
+
+  /**
+   * Enable or disable KLD-sampling. When enabled, resample() draws particles
+   *   until the KL bound over the occupied pose bins is met, within the
+   *   configured limits. Both particle buffers are reserved for the upper
+   *   limit.
+   */
+  void SetKldSampling(bool enable, const KldConfig& config = KldConfig()) {
+    use_kld_sampling = enable;
+    kld_config = config;
+    if (enable) {
+      particles.reserve(config.max_particles);
+      back_particles.reserve(config.max_particles);
+    }
+  }
+
+  /**
+   * Give every filter step a latency budget (0 disables). A step starts in
+   *   prediction() (or updateWeights() when there was no prediction).
+   *   updateWeights() then visits the particles in random order and, once
+   *   the budget would be exceeded, sheds the particles it has not reached
+   *   by giving them zero weight. The reached particles are a uniform random
+   *   subset of the prior set, so their normalized weights remain a valid
+   *   importance sample. resample() counts against the same budget: the
+   *   weighting stops early by the measured normalization and resampling
+   *   time of the set, and resample() draws no more particles than were
+   *   reached, growing the set back by a quarter per step while none are
+   *   shed, up to the size without a deadline.
+   * @param budget_ms Time budget from the start of the step to the end of
+   *   resample() [ms]
+   */
+  void SetStepDeadline(double budget_ms) {
+    step_budget_ms = budget_ms;
+  }
+
+  /**
+   * Reached and shed particle counts of the last updateWeights() call.
+   */
+  const DeadlineStats& GetDeadlineStats() const {
+    return deadline_stats;
+  }
+
+  /**
+   * Enable augmented MCL kidnap recovery. updateWeights() tracks a short
+   *   and a long term average of the per observation measurement likelihood. When the short
+   *   term average drops below the long term one, resample() replaces each
+   *   draw with probability max(0, 1 - w_fast / w_slow) by a random
+   *   particle that places one of the observations on a random map landmark.
+   * @param alpha_slow Smoothing factor of the long term average
+   * @param alpha_fast Smoothing factor of the short term average
+   */
+  void SetAugmentedMcl(bool enable, double alpha_slow = 0.001, double alpha_fast = 0.1) {
+    use_augmented_mcl = enable;
+    amcl_alpha_slow = alpha_slow;
+    amcl_alpha_fast = alpha_fast;
+    amcl_stats.log_w_slow = amcl_stats.log_w_fast = -HUGE_VAL;
+    amcl_stats.injection_prob = 0.0;
+    amcl_stats.injected = 0;
+  }
+
+  /**
+   * Likelihood averages and injections of augmented MCL.
+   */
+  const AugmentedMclStats& GetAugmentedMclStats() const {
+    return amcl_stats;
+  }
+
+  /**
+   * Enable the hybrid EKF / particle filter mode. Once the weighted
+   *   posterior has stayed tight for a number of steps, the particles are
+   *   collapsed into an EKF over (x, y, theta) that uses the same motion and
+   *   observation models. While the EKF runs, 'particles' holds a single
+   *   particle at its mean and NumParticles() is 1. When the smoothed NIS
+   *   of the observations shows the EKF is no longer consistent, its update
+   *   is discarded, particles are drawn again from the inflated predicted
+   *   covariance and the step is redone by the particle filter.
+   */
+  void SetHybridEkf(bool enable, const HybridConfig& config = HybridConfig()) {
+    use_hybrid_ekf = enable;
+    hybrid_config = config;
+  }
+
+  /**
+   * Current mode and time spent in each mode.
+   */
+  const HybridStats& GetHybridStats() const {
+    return hybrid_stats;
+  }
+
+  /**
+   * Enable weighting by a precomputed likelihood field (likelihood_field.h)
+   *   instead of associating every observation with its nearest landmark
+   *   in range. The field is built on the next updateWeights() call.
+   *   Particles then carry their transformed observations but no
+   *   associations.
+   * @param resolution Requested grid spacing [m]
+   * @param max_bytes Memory bound of the field; the spacing is coarsened to fit
+   */
+  void SetLikelihoodField(bool enable, double resolution = 0.1,
+                          size_t max_bytes = 64 * 1024 * 1024) {
+    use_likelihood_field = enable;
+    likelihood_field_stale = likelihood_field_stale || resolution != field_resolution ||
+                             max_bytes != field_max_bytes;
+    field_resolution = resolution;
+    field_max_bytes = max_bytes;
+  }
+
+  /**
+   * The likelihood field, valid after the first updateWeights() call with
+   *   the field enabled.
+   */
+  const LikelihoodField& GetLikelihoodField() const {
+    return likelihood_field;
+  }
+
+  /**
+   * Enable or disable the warm-start association cache. When enabled each
+   *   observation is first checked against the landmark it was associated
+   *   with in the previous step, and only falls back to the full nearest
+   *   neighbour search when that match cannot be verified locally.
+   *   The result is identical to the full search.
+   */
+  void SetAssociationCache(bool enable) {
+    use_association_cache = enable;
+  }
+
+  /**
+   * Enable global nearest neighbour association. Observations are gated by
+   *   their squared Mahalanobis distance to the landmarks in range, and
+   *   when two of them claim the same landmark, all are assigned to
+   *   distinct landmarks minimizing the total distance (assignment.h).
+   *   An observation outside every gate is weighted by its nearest
+   *   landmark, as without assignment, and one that lost its landmark to
+   *   another observation as if it lay on the gate. Replaces the nearest
+   *   neighbour search and its cache.
+   * @param gate Squared Mahalanobis distance gate; 9.21 is the 99% point
+   *   of the chi-square distribution with 2 degrees of freedom
+   */
+  void SetAssignmentAssociation(bool enable, double gate = 9.21) {
+    use_assignment = enable;
+    assignment_gate = gate;
+  }
+
+  /**
+   * Enable early termination of hopeless particles. While weighting, the
+   *   best complete log weight so far is shared between the workers, and a
+   *   particle is dropped (weight 0) as soon as its log weight plus the
+   *   largest possible log-likelihood of its remaining observations falls
+   *   more than 'margin' below it. A dropped particle would have had less
+   *   than exp(-margin) of the best weight. Which particles are dropped
+   *   depends on the order they are visited in, so results are no longer
+   *   independent of the thread count. Applies to nearest neighbour
+   *   weighting only.
+   * @param margin Log weight margin below the best particle
+   */
+  void SetEarlyTermination(bool enable, double margin = 20.0) {
+    use_pruning = enable;
+    prune_margin = margin;
+  }
+
+  /**
+   * Enable two-stage weighting. A coarse likelihood field (likelihood_field.h)
+   *   with standard deviations widened to its spacing scores every particle
+   *   first, on a few evenly spaced observations. Each particle is then drawn for the exact weighting with
+   *   probability p = min(1, c q), where q is its share of the coarse
+   *   weight and c makes the expected number drawn 'fraction' of the
+   *   particles. Drawn particles get their exact weight divided by p,
+   *   the others weight 0, so every weight stays unbiased. Not used with a
+   *   step deadline.
+   * @param fraction Expected fraction of the particles weighted exactly
+   * @param coarse_resolution Spacing of the coarse field [m]
+   */
+  void SetTwoStageWeighting(bool enable, double fraction = 0.1,
+                            double coarse_resolution = 1.0) {
+    use_two_stage = enable;
+    two_stage_fraction = fraction;
+    coarse_field_stale = coarse_field_stale || coarse_resolution != coarse_field_resolution;
+    coarse_field_resolution = coarse_resolution;
+  }
+
+  /**
+   * Bound the observations used per update (0 for all). When a frame has
+   *   more, updateWeights() first picks a subset spread around the vehicle:
+   *   the observations are bucketed by bearing into 'max_observations'
+   *   sectors and taken nearest first from every sector in turn. The
+   *   selection is done once per frame, so the per particle cost no longer
+   *   grows with the sensor density. Fewer observations also make the
+   *   likelihood less peaked.
+   */
+  void SetObservationLimit(int max_observations) {
+    observation_limit = max_observations;
+  }
+
+  /**
+   * Store the particles along a Hilbert curve over the map after every
+   *   resampling, so consecutive particles, and the blocks of them handed to
+   *   the workers, query the same landmark index cells. The order is free:
+   *   resample() writes the copies of the drawn particles source by source
+   *   and only the order of the sources changes.
+   */
+  void SetSpatialOrdering(bool enable) {
+    use_spatial_order = enable;
+  }
+
+  /**
+   * Keep the resampled set encoded as (parent, multiplicity) pairs. Then
+   *   resample() writes every drawn parent once, and prediction() expands
+   *   the copies while adding their noise. While encoded, 'particles' holds
+   *   the distinct parents, Multiplicity() their copy counts, and weight
+   *   sums count every copy. An updateWeights() call before prediction()
+   *   weights each parent once for all its copies.
+   */
+  void SetMultiplicityEncoding(bool enable) {
+    use_multiplicity = enable;
+  }
+
+  /**
+   * Copy counts of the entries of 'particles' while the set is encoded,
+   *   empty otherwise.
+   */
+  const std::vector<int>& Multiplicity() const {
+    return multiplicity;
+  }
+
+  /**
+   * Number of particles, counting the copies of an encoded set.
+   */
+  int NumParticles() const {
+    return num_particles;
+  }
+
+  /**
+   * Most memory the step temporaries have used at once [bytes].
+   */
+  size_t ArenaHighWater() const {
+    return frame_arena.HighWater();
+  }
+
+  /**
+   * Association and weighting counters of the last updateWeights() call.
+   */
+  const AssociationStats& GetAssociationStats() const {
+    return assoc_stats;
+  }
+
+  /**
+   * Fraction of observations in the last updateWeights() call that were
+   *   resolved by the association cache without a full search.
+   */
+  double AssociationCacheHitRate() const {
+    if (assoc_stats.lookups == 0) {
+      return 0.0;
+    }
+    return double(assoc_stats.gate_hits + assoc_stats.local_hits) / assoc_stats.lookups;
+  }
+
+  /**
+   * Set the number of worker threads for the per-particle stages. Results
+   *   do not depend on the thread count.
+   */
+  void SetNumThreads(int threads) {
+    num_threads = threads > 0 ? threads : 1;
+    workers.Resize(num_threads);
+  }
+
+  /**
+   * Weight sum, effective sample size, highest weight and weighted mean
+   *   of the current particle set.
+   */
+  WeightSummary SummarizeWeights() const;
+
+  /**
+   * Weighted mean pose and covariance of the particles, computed by the
+   *   normalization pass of the last updateWeights() call.
+   */
+  const PoseEstimate& GetPoseEstimate() const {
+    return pose_estimate;
+  }
+
   /**
    * Set a particles list of associations, along with the associations'
    *   calculated world x,y coordinates
@@ -138,6 +651,275 @@ class ParticleFilter {
   
   // Vector of weights of all particles
   std::vector<double> weights; 
+
+  // Worker threads for the per-particle stages
+  int num_threads;
+  mutable WorkerPool workers;
+
+  // Particle count to shrink to after global initialization, 0 if fixed
+  int converged_particles;
+
+  // Particle count of init()
+  int init_particles;
+
+  // Particle count resample() draws without a step deadline
+  int target_particles;
+
+  // Step deadline: budget, start of the current step and last results
+  double step_budget_ms;
+  bool step_started;
+  std::chrono::steady_clock::time_point step_start;
+  DeadlineStats deadline_stats;
+  long long block_ns_estimate;
+  long long tail_ns_estimate;  // Normalization and resample time per particle
+  bool deadline_pending;       // Weighted under the deadline, not resampled yet
+  std::vector<int> visit_order;
+
+  // Random engine of the per step decisions (visit order, injection)
+  std::default_random_engine step_gen;
+
+  // Random engine of the resampling draws, continued from step to step
+  std::default_random_engine resample_gen;
+
+  // Batched Gaussian noise of init() and prediction()
+  CounterRng noise_rng;
+
+  // Augmented MCL settings, likelihood averages and the observations of the
+  //   last update (used to place injected particles)
+  bool use_augmented_mcl;
+  double amcl_alpha_slow;
+  double amcl_alpha_fast;
+  AugmentedMclStats amcl_stats;
+  std::vector<LandmarkObs> last_observations;
+
+  /**
+   * Random pose placing a random observation of the last update on a
+   *   random landmark, or uniform over the map without observations.
+   */
+  Particle RandomParticle(std::default_random_engine& gen) const;
+
+  // Hybrid EKF / particle filter mode
+  bool use_hybrid_ekf;
+  HybridConfig hybrid_config;
+  HybridStats hybrid_stats;
+  PoseEkf ekf;
+  int tight_steps;
+
+  /**
+   * EKF measurement update with nearest neighbour association. Returns
+   *   false if the smoothed NIS shows the EKF is inconsistent.
+   */
+  bool EkfUpdate(double sensor_range, double std_landmark[],
+                 const std::vector<LandmarkObs> &observations);
+
+  /**
+   * Switch to the EKF if the particle posterior has been tight long enough.
+   */
+  void CheckCollapse();
+
+  /**
+   * Redraw the particles from the EKF and switch back to particle mode.
+   */
+  void ExpandFromEkf();
+
+  // KLD-sampling settings and its histogram of occupied pose bins
+  bool use_kld_sampling;
+  KldConfig kld_config;
+  GridHash kld_bins;
+
+  // Weighted sums over the particles, relative to a reference pose
+  struct WeightMoments {
+    double ref_x, ref_y, ref_theta;
+    double sum, sum_sq;
+    double sum_x, sum_y, sum_t, sum_cos, sum_sin;
+    double sum_xx, sum_xy, sum_xt, sum_yy, sum_yt, sum_tt;
+    double max_weight;
+    int max_index;
+  };
+
+  /**
+   * Single deterministic pass over the particles collecting all weight
+   *   moments. Used for normalization, the pose estimate and the summary.
+   */
+  WeightMoments ReduceWeights() const;
+  static PoseEstimate EstimateFromMoments(const WeightMoments& moments);
+
+  // Posterior estimate from the last updateWeights()
+  PoseEstimate pose_estimate;
+
+  // Per cell sums of FindModes(), kept to reuse their storage
+  struct ModeCell {
+    int cx, cy;
+    int count;
+    double weight, sum_x, sum_y, sum_cos, sum_sin;
+    int parent;
+  };
+  GridHash mode_grid;
+  std::vector<ModeCell> mode_cells;
+  std::vector<ModeCell> mode_sums;
+
+  // Per worker temporaries of updateWeights(), kept between steps so
+  //   their capacity is reused
+  struct WeightScratch {
+    WeightScratch() : best_log_weight(NULL) {}
+
+    std::vector<LandmarkObs> observations_mapCoordinates;
+    std::vector<LandmarkObs> predictedLMs;
+    std::vector<int> landmarksInRange;
+    AssociationStats stats;
+
+    // Gated assignment: squared distances, nearest or assigned landmark
+    //   per observation, claims per landmark, the rows and columns of the
+    //   gated subgraph (with the column of each landmark, or -1) and its
+    //   matching, cost matrix and solver
+    std::vector<double> gate_dist;
+    std::vector<int> assigned;
+    std::vector<int> claims;
+    std::vector<int> gated_rows;
+    std::vector<int> gated_cols;
+    std::vector<int> gated_col_of;
+    std::vector<int> gated_match;
+    std::vector<double> assignment_cost;
+    AssignmentSolver solver;
+
+    // Best complete log weight of the current update, shared by the workers
+    std::atomic<double>* best_log_weight;
+  };
+  std::vector<WeightScratch> worker_scratch;
+
+  // Back buffer of resample(), swapped with 'particles'
+  std::vector<Particle> back_particles;
+
+  // Temporaries of one step, released when the next step starts and at the
+  //   end of resample()
+  mutable FrameArena frame_arena;
+
+  /**
+   * Transform, associate and weight the observations for one particle.
+   */
+  void UpdateParticle(Particle& particle, double sensor_range, double std_landmark[],
+                      const std::vector<LandmarkObs> &observations,
+                      WeightScratch& scratch);
+
+  /**
+   * Associate observations (map coordinates) with the predicted landmarks,
+   *   seeding each search with the particle's association from the last step.
+   */
+  void AssociateWithCache(const Particle& particle, double sensor_range,
+                          const std::vector<LandmarkObs>& predicted,
+                          std::vector<LandmarkObs>& observations,
+                          AssociationStats& stats) const;
+
+  /**
+   * Id of the predicted landmark nearest to observation 'm' (map
+   *   coordinates), seeded with the particle's association from the last step.
+   */
+  int AssociateObservation(const Particle& particle, uint m, double sensor_range,
+                           const std::vector<LandmarkObs>& predicted,
+                           const LandmarkObs& obs, AssociationStats& stats) const;
+
+  /**
+   * UpdateParticle() with early termination: associates and weights one
+   *   observation at a time and stops once the particle cannot come within
+   *   'prune_margin' of the best weighted so far.
+   */
+  void WeightWithPruning(Particle& particle, double sensor_range, double std_landmark[],
+                         const std::vector<LandmarkObs> &observations,
+                         WeightScratch& scratch);
+
+  /**
+   * Gate the observations (map coordinates) and assign them to distinct
+   *   predicted landmarks. Returns the log-likelihood of the observations.
+   */
+  double AssociateByAssignment(double std_landmark[], const std::vector<LandmarkObs>& predicted,
+                               std::vector<LandmarkObs>& observations,
+                               WeightScratch& scratch) const;
+
+  // Spatial index over the map landmarks, built on first use
+  LandmarkIndex landmark_index;
+
+  // Optional likelihood field weighting
+  bool use_likelihood_field;
+  bool likelihood_field_stale;
+  double field_resolution;
+  size_t field_max_bytes;
+  LikelihoodField likelihood_field;
+
+  // Warm-start association cache and its statistics for the last update
+  bool use_association_cache;
+  AssociationStats assoc_stats;
+
+  // Gated global nearest neighbour association
+  bool use_assignment;
+  double assignment_gate;
+
+  // Early termination of hopeless particles
+  bool use_pruning;
+  double prune_margin;
+
+  // Observation subset selection and the subset of the current update
+  int observation_limit;
+  std::vector<LandmarkObs> observation_subset;
+
+  /**
+   * The observations to weight with: 'observations' itself, or a subset
+   *   of at most 'observation_limit' spread over the bearings, in their
+   *   original order.
+   */
+  const std::vector<LandmarkObs>& SelectObservations(const std::vector<LandmarkObs>& observations);
+
+  // Hilbert curve order of the particles after resampling
+  bool use_spatial_order;
+
+  // Multiplicity encoding of the resampled set; 'multiplicity' is empty
+  //   while the particles are stored one by one
+  bool use_multiplicity;
+  std::vector<int> multiplicity;
+
+  /**
+   * Write out the copies of an encoded set.
+   */
+  void ExpandParticles();
+
+  // Look-ahead log-likelihoods of the auxiliary filter step, and whether
+  //   the next updateWeights() divides them out
+  std::vector<double> aux_look;
+  bool aux_pending;
+
+  /**
+   * Normalize the weights of a weighted set, update the pose estimate and
+   *   the augmented MCL averages, and check for an EKF collapse.
+   */
+  void NormalizeWeights(const std::vector<LandmarkObs>& observations);
+
+  /**
+   * (Re)build the landmark index and the likelihood fields in use.
+   * @param coarse Also (re)build the coarse field
+   */
+  void PrepareMap(const Map& map_landmarks, double sensor_range, double std_landmark[],
+                  bool coarse);
+
+  /**
+   * Log-likelihood under the coarse field of a few evenly spaced
+   *   observations, seen from pose (x, y) with the given heading.
+   */
+  double CoarseLogLikelihood(double x, double y, double cos_theta, double sin_theta,
+                             const std::vector<LandmarkObs>& observations) const;
+
+  // Two-stage weighting and its coarse likelihood field
+  bool use_two_stage;
+  double two_stage_fraction;
+  bool coarse_field_stale;
+  double coarse_field_resolution;
+  LikelihoodField coarse_field;
+
+  /**
+   * First stage of two-stage weighting: score the particles by the coarse
+   *   field and draw those weighted exactly. Sets 'inclusion' to the
+   *   inclusion probability of the drawn particles and 0 for the others.
+   */
+  void SelectForExactWeighting(const std::vector<LandmarkObs>& observations,
+                               ArenaVector<double>& inclusion);
 };
 
 #endif  // PARTICLE_FILTER_H_
\ No newline at end of file
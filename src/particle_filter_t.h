@@ -0,0 +1,520 @@
+/**
+ * particle_filter_t.h
+ * Policy based particle filter core, a prototype for pf_benchmark.
+ *
+ * The scalar type, motion model, data association, measurement model and
+ * resampling scheme are template parameters. Every combination is compiled
+ * into its own loops with the policies inlined, without virtual dispatch.
+ * Particles are stored as a structure of arrays.
+ *
+ * ParticleFilter is not an instantiation of this template and is not
+ * replaced by it. The template covers only the plain predict, weight and
+ * resample loop. The association cache, KLD-sampling, augmented MCL, the
+ * hybrid EKF, the step deadline, likelihood field weighting and early
+ * termination exist in ParticleFilter only. The template is used to
+ * measure what specialised cores (e.g. FloatParticleFilter) would gain.
+ *
+ * The random numbers, reductions and resampling draws are those of
+ * ParticleFilter, so with the default policies and the same seed both
+ * filters produce the same particles.
+ *
+ * A policy class provides:
+ *   Motion       void Predict(Scalar* x, Scalar* y, Scalar* theta, int n,
+ *                             Scalar delta_t, const Scalar std_pos[],
+ *                             Scalar velocity, Scalar yaw_rate, CounterRng& gen)
+ *   Associator   void Associate(const Scalar* mx, const Scalar* my, int num_obs,
+ *                               const Scalar* lm_x, const Scalar* lm_y, int num_lm,
+ *                               int* match, Scalar* dist2) const
+ *                  sets match[m] to the landmark of observation m or -1;
+ *                  'dist2' is scratch space for 'num_obs' values
+ *   Measurement  void Configure(const Scalar std_landmark[])
+ *                Scalar LogLikelihood(Scalar dx, Scalar dy) const
+ *                Scalar LogMiss() const  (unassociated observation)
+ *   Resampler    void Resample(const std::vector<Scalar>& weight, int count,
+ *                              std::vector<int>& picks)
+ */
+
+#ifndef PARTICLE_FILTER_T_H_
+#define PARTICLE_FILTER_T_H_
+
+#include <math.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <vector>
+#include "fast_random.h"
+#include "helper_functions.h"
+#include "landmark_index.h"
+#include "motion_model.h"
+#include "parallel.h"
+
+/**
+ * CTRV motion with additive Gaussian noise, as ParticleFilter::prediction().
+ *   The noise of all particles is generated in one batch from the filter's
+ *   stream.
+ */
+template <class Scalar>
+class CtrvMotion {
+ public:
+  void Predict(Scalar* x, Scalar* y, Scalar* theta, int n, Scalar delta_t,
+               const Scalar std_pos[], Scalar velocity, Scalar yaw_rate, CounterRng& gen) {
+    noise.resize(3 * n);
+    Scalar* noise_x = noise.data();
+    Scalar* noise_y = noise_x + n;
+    Scalar* noise_theta = noise_y + n;
+    gen.FillNormal(noise_x, n, 0.0, std_pos[0]);
+    gen.FillNormal(noise_y, n, 0.0, std_pos[1]);
+    gen.FillNormal(noise_theta, n, 0.0, std_pos[2]);
+
+    const CtrvModel<Scalar> model(delta_t, velocity, yaw_rate);
+    for (int k=0; k<n; k++)
+    {
+      Scalar c1, s1;
+      model.Move(x[k], y[k], cos(theta[k]), sin(theta[k]), c1, s1);
+      x[k] += noise_x[k];
+      y[k] += noise_y[k];
+      theta[k] += model.DeltaTheta() + noise_theta[k];
+    }
+  }
+
+ private:
+  std::vector<Scalar> noise;
+};
+
+/**
+ * Nearest landmark in range, the first one given on ties. The loop over
+ *   the observations is innermost and branch free, so it vectorizes.
+ */
+template <class Scalar>
+class NearestNeighbourAssociator {
+ public:
+  void Associate(const Scalar* mx, const Scalar* my, int num_obs,
+                 const Scalar* lm_x, const Scalar* lm_y, int num_lm,
+                 int* match, Scalar* dist2) const {
+    for (int m=0; m<num_obs; m++)
+    {
+      dist2[m] = std::numeric_limits<Scalar>::max();
+      match[m] = -1;
+    }
+    for (int k=0; k<num_lm; k++)
+    {
+      const Scalar lx = lm_x[k];
+      const Scalar ly = lm_y[k];
+      for (int m=0; m<num_obs; m++)
+      {
+        Scalar dx = lx - mx[m];
+        Scalar dy = ly - my[m];
+        Scalar d2 = dx * dx + dy * dy;
+        Scalar best = dist2[m];
+        int bestMatch = match[m];
+        match[m] = d2 < best ? k : bestMatch;
+        dist2[m] = std::min(d2, best);
+      }
+    }
+  }
+};
+
+/**
+ * Independent Gaussian errors in map x and y, as log_multiv_prob().
+ */
+template <class Scalar>
+class GaussianMeasurement {
+ public:
+  GaussianMeasurement() : half_inv_var_x(0), half_inv_var_y(0), log_norm(0) {}
+
+  void Configure(const Scalar std_landmark[]) {
+    half_inv_var_x = Scalar(0.5) / (std_landmark[0] * std_landmark[0]);
+    half_inv_var_y = Scalar(0.5) / (std_landmark[1] * std_landmark[1]);
+    log_norm = -log(Scalar(2.0 * M_PI) * std_landmark[0] * std_landmark[1]);
+  }
+
+  Scalar LogLikelihood(Scalar dx, Scalar dy) const {
+    return log_norm - (dx * dx * half_inv_var_x + dy * dy * half_inv_var_y);
+  }
+
+  Scalar LogMiss() const {
+    return -std::numeric_limits<Scalar>::infinity();
+  }
+
+ private:
+  Scalar half_inv_var_x;
+  Scalar half_inv_var_y;
+  Scalar log_norm;
+};
+
+/**
+ * Independent draws by the cumulative weights, as ParticleFilter::resample():
+ *   the same engine, continued from step to step, the same sampler, and
+ *   the picks in source order.
+ */
+template <class Scalar>
+class DiscreteResampler {
+ public:
+  void Resample(const std::vector<Scalar>& weight, int count, std::vector<int>& picks) {
+    CumulativeSampler<std::vector<double> > particleDistr(cumulative, (int)weight.size(),
+      [&](int n) { return (double)weight[n]; });
+    copies.assign(weight.size(), 0);
+    for (int n=0; n<count; n++)
+    {
+      copies[particleDistr(gen)]++;
+    }
+    picks.resize(count);
+    int out = 0;
+    for (size_t i=0; i<copies.size(); i++)
+    {
+      for (int c=0; c<copies[i]; c++)
+      {
+        picks[out++] = (int)i;
+      }
+    }
+  }
+
+ private:
+  std::default_random_engine gen;
+  std::vector<double> cumulative;
+  std::vector<int> copies;
+};
+
+/**
+ * Systematic resampling: one uniform offset and 'count' evenly spaced
+ *   pointers into the cumulative weights. O(N) and lower variance than
+ *   independent draws.
+ */
+template <class Scalar>
+class SystematicResampler {
+ public:
+  void Resample(const std::vector<Scalar>& weight, int count, std::vector<int>& picks) {
+    double total = 0.0;
+    for (Scalar w : weight)
+    {
+      total += w;
+    }
+    picks.resize(count);
+    if (weight.empty() || !(total > 0.0))
+    {
+      for (int n=0; n<count; n++)
+      {
+        picks[n] = weight.empty() ? 0 : n % (int)weight.size();
+      }
+      return;
+    }
+
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const double step = total / count;
+    double pointer = unit(gen) * step;
+    double cumulative = weight[0];
+    int i = 0;
+    for (int n=0; n<count; n++)
+    {
+      while (cumulative < pointer && i + 1 < (int)weight.size())
+      {
+        cumulative += weight[++i];
+      }
+      picks[n] = i;
+      pointer += step;
+    }
+  }
+
+ private:
+  std::default_random_engine gen;
+};
+
+/**
+ * Particle filter core with compile time policies. The interface follows
+ *   that of ParticleFilter's basic loop: init(), prediction(),
+ *   updateWeights(), resample().
+ */
+template <class Scalar,
+          class Motion = CtrvMotion<Scalar>,
+          class Associator = NearestNeighbourAssociator<Scalar>,
+          class Measurement = GaussianMeasurement<Scalar>,
+          class Resampler = DiscreteResampler<Scalar> >
+class ParticleFilterT {
+ public:
+  typedef Scalar scalar_type;
+
+  explicit ParticleFilterT(int num_particles = 100)
+    : num_particles(num_particles), num_threads(1), is_initialized(false) {}
+
+  /**
+   * Initialize the particles around a first pose estimate, all weights 1.
+   * @param std[] Standard deviation of x [m], y [m] and yaw [rad]
+   */
+  void init(double x0, double y0, double theta0, double std[]) {
+    x.resize(num_particles);
+    y.resize(num_particles);
+    theta.resize(num_particles);
+    weight.assign(num_particles, Scalar(1));
+    noise_rng.FillNormal(x.data(), num_particles, x0, std[0]);
+    noise_rng.FillNormal(y.data(), num_particles, y0, std[1]);
+    noise_rng.FillNormal(theta.data(), num_particles, theta0, std[2]);
+    is_initialized = true;
+  }
+
+  /**
+   * Move every particle by the motion model.
+   */
+  void prediction(double delta_t, double std_pos[], double velocity, double yaw_rate) {
+    const Scalar stdPos[3] = {(Scalar)std_pos[0], (Scalar)std_pos[1], (Scalar)std_pos[2]};
+    motion.Predict(x.data(), y.data(), theta.data(), num_particles, (Scalar)delta_t,
+                   stdPos, (Scalar)velocity, (Scalar)yaw_rate, noise_rng);
+  }
+
+  /**
+   * Weight every particle by the likelihood of the observations (vehicle
+   *   coordinates) and normalize the weights.
+   */
+  void updateWeights(double sensor_range, double std_landmark[],
+                     const std::vector<LandmarkObs> &observations,
+                     const Map &map_landmarks) {
+    if (!landmark_index.IsBuiltFrom(map_landmarks))
+    {
+      // Landmark copy in Scalar precision, ordered by grid cell so the
+      //   landmarks of a cell are contiguous
+      landmark_index.Build(map_landmarks, sensor_range, 0);
+      const std::vector<int>& members = landmark_index.CellMembers();
+      lm_x.resize(members.size());
+      lm_y.resize(members.size());
+      lm_id.resize(members.size());
+      for (size_t k=0; k<members.size(); k++)
+      {
+        lm_x[k] = (Scalar)landmark_index.x[members[k]];
+        lm_y[k] = (Scalar)landmark_index.y[members[k]];
+        lm_id[k] = landmark_index.id[members[k]];
+      }
+    }
+    const Scalar stdLandmark[2] = {(Scalar)std_landmark[0], (Scalar)std_landmark[1]};
+    measurement.Configure(stdLandmark);
+
+    obs_x.resize(observations.size());
+    obs_y.resize(observations.size());
+    for (size_t m=0; m<observations.size(); m++)
+    {
+      obs_x[m] = (Scalar)observations[m].x;
+      obs_y[m] = (Scalar)observations[m].y;
+    }
+
+    log_weight.resize(num_particles);
+    scratch.resize(num_threads);
+    ParallelForWorkers(num_particles, 64, workers, [&](int worker, int block, int begin, int end) {
+      for (int n=begin; n<end; n++)
+      {
+        log_weight[n] = LogLikelihood(n, sensor_range, obs_x, obs_y, scratch[worker], NULL, NULL, NULL);
+      }
+    });
+
+    // Normalize with the reductions of ParticleFilter::NormalizeWeights()
+    weight.resize(num_particles);
+    for (int n=0; n<num_particles; n++)
+    {
+      weight[n] = exp(log_weight[n]);
+    }
+    double sum = ParallelSum(num_particles, workers, [&](int n) { return (double)weight[n]; });
+    if (!(sum > 1e-5))
+    {
+      // Weights underflowed, rescale them relative to the most likely particle
+      Scalar maxLog = ParallelReduce(num_particles, workers, -std::numeric_limits<Scalar>::infinity(),
+        [&](int begin, int end) {
+          Scalar m = -std::numeric_limits<Scalar>::infinity();
+          for (int n=begin; n<end; n++)
+          {
+            m = std::max(m, log_weight[n]);
+          }
+          return m;
+        },
+        [](Scalar a, Scalar b) { return std::max(a, b); });
+      for (int n=0; n<num_particles; n++)
+      {
+        weight[n] = std::isfinite(maxLog) ? exp(log_weight[n] - maxLog) : Scalar(1);
+      }
+      sum = ParallelSum(num_particles, workers, [&](int n) { return (double)weight[n]; });
+    }
+    for (int n=0; n<num_particles; n++)
+    {
+      weight[n] = (Scalar)(weight[n] / sum);
+    }
+  }
+
+  /**
+   * Draw a new particle set with probability proportional to the weights.
+   */
+  void resample() {
+    resampler.Resample(weight, num_particles, picks);
+    Gather(x);
+    Gather(y);
+    Gather(theta);
+    weight.assign(num_particles, Scalar(1) / num_particles);
+  }
+
+  /**
+   * Index of the first particle with the highest weight.
+   */
+  int BestIndex() const {
+    return (int)(std::max_element(weight.begin(), weight.end()) - weight.begin());
+  }
+
+  /**
+   * Associations of particle 'n' with the observations, in the format of
+   *   ParticleFilter::SetAssociations(). Recomputed on demand, the hot loop
+   *   does not store them.
+   */
+  void GetAssociations(int n, double sensor_range, const std::vector<LandmarkObs> &observations,
+                       std::vector<int>& associations, std::vector<double>& sense_x,
+                       std::vector<double>& sense_y) const {
+    std::vector<Scalar> ox(observations.size());
+    std::vector<Scalar> oy(observations.size());
+    for (size_t m=0; m<observations.size(); m++)
+    {
+      ox[m] = (Scalar)observations[m].x;
+      oy[m] = (Scalar)observations[m].y;
+    }
+    Scratch local;
+    LogLikelihood(n, sensor_range, ox, oy, local, &associations, &sense_x, &sense_y);
+  }
+
+  void SetNumThreads(int threads) {
+    num_threads = std::max(1, threads);
+    workers.Resize(num_threads);
+  }
+
+  int size() const {
+    return num_particles;
+  }
+
+  const bool initialized() const {
+    return is_initialized;
+  }
+
+  // Particle state, one entry per particle
+  std::vector<Scalar> x;
+  std::vector<Scalar> y;
+  std::vector<Scalar> theta;
+  std::vector<Scalar> weight;
+
+ private:
+  // Per worker buffers of the weighting, kept across steps
+  struct Scratch {
+    std::vector<Scalar> lm_x;   // Landmarks in range
+    std::vector<Scalar> lm_y;
+    std::vector<int> lm_id;
+    std::vector<Scalar> mx;     // Observations in map coordinates
+    std::vector<Scalar> my;
+    std::vector<int> match;     // Associated landmark in range, or -1
+    std::vector<Scalar> dist2;
+  };
+
+  /**
+   * Log likelihood of the observations (ox, oy) for particle 'n'. Fills the
+   *   associations if the output pointers are given.
+   */
+  Scalar LogLikelihood(int n, double sensor_range, const std::vector<Scalar>& ox,
+                       const std::vector<Scalar>& oy, Scratch& sc,
+                       std::vector<int>* associations, std::vector<double>* sense_x,
+                       std::vector<double>* sense_y) const {
+    // Landmarks in range, from the cells around the particle
+    const Scalar px = x[n];
+    const Scalar py = y[n];
+    const Scalar range = (Scalar)sensor_range;
+    sc.lm_x.clear();
+    sc.lm_y.clear();
+    sc.lm_id.clear();
+    landmark_index.ForEachCell(px, py, sensor_range, [&](int begin, int end) {
+      for (int k=begin; k<end; k++)
+      {
+        Scalar dx = lm_x[k] - px;
+        Scalar dy = lm_y[k] - py;
+        if (sqrt(dx * dx + dy * dy) < range)
+        {
+          sc.lm_x.push_back(lm_x[k]);
+          sc.lm_y.push_back(lm_y[k]);
+          sc.lm_id.push_back(lm_id[k]);
+        }
+      }
+    });
+
+    // Observations in map coordinates
+    const int numObs = (int)ox.size();
+    sc.mx.resize(numObs);
+    sc.my.resize(numObs);
+    sc.match.resize(numObs);
+    sc.dist2.resize(numObs);
+    const Scalar c = cos(theta[n]);
+    const Scalar s = sin(theta[n]);
+    for (int m=0; m<numObs; m++)
+    {
+      sc.mx[m] = px + c * ox[m] - s * oy[m];
+      sc.my[m] = py + s * ox[m] + c * oy[m];
+    }
+
+    associator.Associate(sc.mx.data(), sc.my.data(), numObs, sc.lm_x.data(), sc.lm_y.data(),
+                         (int)sc.lm_x.size(), sc.match.data(), sc.dist2.data());
+
+    Scalar logWeight = 0;
+    for (int m=0; m<numObs; m++)
+    {
+      const int k = sc.match[m];
+      logWeight += k >= 0 ? measurement.LogLikelihood(sc.mx[m] - sc.lm_x[k], sc.my[m] - sc.lm_y[k])
+                          : measurement.LogMiss();
+    }
+    if (associations)
+    {
+      associations->clear();
+      sense_x->clear();
+      sense_y->clear();
+      for (int m=0; m<numObs; m++)
+      {
+        associations->push_back(sc.match[m] >= 0 ? sc.lm_id[sc.match[m]] : -1);
+        sense_x->push_back(sc.mx[m]);
+        sense_y->push_back(sc.my[m]);
+      }
+    }
+    return logWeight;
+  }
+
+  void Gather(std::vector<Scalar>& v) {
+    gathered.resize(num_particles);
+    for (int n=0; n<num_particles; n++)
+    {
+      gathered[n] = v[picks[n]];
+    }
+    v.swap(gathered);
+  }
+
+  int num_particles;
+  int num_threads;
+  WorkerPool workers;
+  bool is_initialized;
+
+  // Gaussian noise of init() and prediction(), as ParticleFilter
+  CounterRng noise_rng;
+
+  Motion motion;
+  Associator associator;
+  Measurement measurement;
+  Resampler resampler;
+
+  // Landmarks in the cell order of the index (LandmarkIndex::CellMembers())
+  LandmarkIndex landmark_index;
+  std::vector<Scalar> lm_x;
+  std::vector<Scalar> lm_y;
+  std::vector<int> lm_id;
+
+  // Observations of the current step in vehicle coordinates
+  std::vector<Scalar> obs_x;
+  std::vector<Scalar> obs_y;
+
+  std::vector<Scalar> log_weight;
+  std::vector<Scratch> scratch;
+  std::vector<int> picks;
+  std::vector<Scalar> gathered;
+};
+
+// Double precision core with the models of ParticleFilter's basic loop
+typedef ParticleFilterT<double> BasicParticleFilter;
+
+// Single precision variant: half the memory traffic per particle and twice
+//   the SIMD width. Float resolves map positions to about 2e-5 m at 300 m.
+typedef ParticleFilterT<float> FloatParticleFilter;
+
+#endif  // PARTICLE_FILTER_T_H_
@@ -0,0 +1,126 @@
+/**
+ * pose_ekf.h
+ * Extended Kalman filter over the vehicle pose (x, y, theta), using the same
+ * CTRV motion model and landmark observation model as the particle filter.
+ */
+
+#ifndef POSE_EKF_H_
+#define POSE_EKF_H_
+
+#include <math.h>
+#include "motion_model.h"
+
+class PoseEkf {
+ public:
+  PoseEkf() {
+    for (int r=0; r<3; r++) {
+      x[r] = 0.0;
+      for (int c=0; c<3; c++) {
+        P[r][c] = 0.0;
+      }
+    }
+  }
+
+  /**
+   * Predict with the CTRV model of ParticleFilter::prediction(), adding the
+   *   same per step noise as process noise.
+   * @param delta_t Time step [s]
+   * @param std_pos[] Standard deviation of x [m], y [m] and yaw [rad]
+   * @param velocity Velocity [m/s]
+   * @param yaw_rate Yaw rate [rad/s]
+   */
+  void Predict(double delta_t, const double std_pos[], double velocity, double yaw_rate) {
+    const CtrvModel<double> motion(delta_t, velocity, yaw_rate);
+    double c0 = cos(x[2]);
+    double s0 = sin(x[2]);
+    double c1, s1;
+    motion.Move(x[0], x[1], c0, s0, c1, s1);
+    x[2] += motion.DeltaTheta();
+
+    double F[3][3] = {{1.0, 0.0, 0.0}, {0.0, 1.0, 0.0}, {0.0, 0.0, 1.0}};
+    motion.HeadingJacobian(c0, s0, c1, s1, F[0][2], F[1][2]);
+
+    // P = F P F^T + Q
+    double FP[3][3];
+    for (int r=0; r<3; r++) {
+      for (int c=0; c<3; c++) {
+        FP[r][c] = F[r][0] * P[0][c] + F[r][1] * P[1][c] + F[r][2] * P[2][c];
+      }
+    }
+    for (int r=0; r<3; r++) {
+      for (int c=0; c<3; c++) {
+        P[r][c] = FP[r][0] * F[c][0] + FP[r][1] * F[c][1] + FP[r][2] * F[c][2];
+      }
+      P[r][r] += std_pos[r] * std_pos[r];
+    }
+  }
+
+  /**
+   * Update with one observation (vehicle coordinates) of a known landmark.
+   *   As in updateWeights(), the observation is transformed into map
+   *   coordinates and compared with the landmark position.
+   * @param obs_x, obs_y Observation in vehicle coordinates [m]
+   * @param lm_x, lm_y Associated landmark in map coordinates [m]
+   * @param std_landmark[] Observation standard deviation in x and y [m]
+   * @param nis_gate Observations with a larger NIS are rejected
+   * @output Normalized innovation squared of the observation
+   */
+  double Update(double obs_x, double obs_y, double lm_x, double lm_y,
+                const double std_landmark[], double nis_gate) {
+    double c = cos(x[2]);
+    double s = sin(x[2]);
+
+    // Innovation and Jacobian of the map coordinate observation
+    double y0 = lm_x - (x[0] + c * obs_x - s * obs_y);
+    double y1 = lm_y - (x[1] + s * obs_x + c * obs_y);
+    double H[2][3] = {{1.0, 0.0, -s * obs_x - c * obs_y},
+                      {0.0, 1.0, c * obs_x - s * obs_y}};
+
+    // S = H P H^T + R
+    double PHt[3][2];
+    for (int r=0; r<3; r++) {
+      for (int k=0; k<2; k++) {
+        PHt[r][k] = P[r][0] * H[k][0] + P[r][1] * H[k][1] + P[r][2] * H[k][2];
+      }
+    }
+    double S00 = H[0][0] * PHt[0][0] + H[0][1] * PHt[1][0] + H[0][2] * PHt[2][0] + std_landmark[0] * std_landmark[0];
+    double S01 = H[0][0] * PHt[0][1] + H[0][1] * PHt[1][1] + H[0][2] * PHt[2][1];
+    double S11 = H[1][0] * PHt[0][1] + H[1][1] * PHt[1][1] + H[1][2] * PHt[2][1] + std_landmark[1] * std_landmark[1];
+    double det = S00 * S11 - S01 * S01;
+    double Si00 = S11 / det;
+    double Si01 = -S01 / det;
+    double Si11 = S00 / det;
+
+    double nis = y0 * (Si00 * y0 + Si01 * y1) + y1 * (Si01 * y0 + Si11 * y1);
+    if (!(nis <= nis_gate))
+    {
+      return nis;
+    }
+
+    // K = P H^T S^-1, x += K y, P -= K H P
+    double K[3][2];
+    for (int r=0; r<3; r++) {
+      K[r][0] = PHt[r][0] * Si00 + PHt[r][1] * Si01;
+      K[r][1] = PHt[r][0] * Si01 + PHt[r][1] * Si11;
+      x[r] += K[r][0] * y0 + K[r][1] * y1;
+    }
+    double KHP[3][3];
+    for (int r=0; r<3; r++) {
+      for (int c2=0; c2<3; c2++) {
+        KHP[r][c2] = K[r][0] * PHt[c2][0] + K[r][1] * PHt[c2][1];
+      }
+    }
+    for (int r=0; r<3; r++) {
+      for (int c2=0; c2<3; c2++) {
+        P[r][c2] -= KHP[r][c2];
+      }
+    }
+    return nis;
+  }
+
+  // State (x [m], y [m], theta [rad]) and its covariance
+  double x[3];
+  double P[3][3];
+};
+
+#endif  // POSE_EKF_H_
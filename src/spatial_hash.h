@@ -0,0 +1,173 @@
+/**
+ * spatial_hash.h
+ * Open addressing hash of integer grid cells.
+ *
+ * Cells are identified by a packed 64 bit key and mapped to dense slot
+ * numbers 0..size()-1 in insertion order, so callers can keep their per cell
+ * data in plain arrays indexed by slot.
+ */
+
+#ifndef SPATIAL_HASH_H_
+#define SPATIAL_HASH_H_
+
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+class GridHash {
+ public:
+  GridHash() : count(0), mask(0) {}
+
+  /**
+   * Pack 2D (32 bits per axis) or 3D (21 bits per axis) cell coordinates
+   *   into a key.
+   */
+  static uint64_t CellKey(int cx, int cy) {
+    return ((uint64_t)(uint32_t)cx << 32) | (uint32_t)cy;
+  }
+  static uint64_t CellKey(int cx, int cy, int ct) {
+    return (((uint64_t)cx & 0x1FFFFF) << 42) | (((uint64_t)cy & 0x1FFFFF) << 21) |
+           ((uint64_t)ct & 0x1FFFFF);
+  }
+
+  /**
+   * Distance of cell (cx, cy), both in [0, 65536), along a Hilbert curve
+   *   through the 65536 x 65536 grid. Cells close on the curve are close
+   *   in the plane.
+   */
+  static uint32_t HilbertKey(uint32_t cx, uint32_t cy) {
+    const uint32_t last = 0xFFFF;
+    uint32_t d = 0;
+    for (uint32_t s=1u << 15; s>0; s>>=1)
+    {
+      uint32_t rx = (cx & s) ? 1 : 0;
+      uint32_t ry = (cy & s) ? 1 : 0;
+      d += s * s * ((3 * rx) ^ ry);
+      // Rotate the quadrant so the curve continues in it
+      if (ry == 0)
+      {
+        if (rx == 1)
+        {
+          cx = last - cx;
+          cy = last - cy;
+        }
+        std::swap(cx, cy);
+      }
+    }
+    return d;
+  }
+
+  /**
+   * Cell coordinate of a position for a given inverse cell size.
+   */
+  static int CellCoord(double v, double inv_cell_size) {
+    return (int)floor(v * inv_cell_size);
+  }
+
+  /**
+   * Remove all cells. The table keeps its capacity, so a hash that is reset
+   *   every frame does not allocate once it has grown to its working size.
+   * @param expected_cells Number of cells expected before the next reset
+   */
+  void Reset(size_t expected_cells) {
+    size_t capacity = 16;
+    while (capacity < 2 * expected_cells) {
+      capacity <<= 1;
+    }
+    if (capacity > keys.size()) {
+      keys.resize(capacity);
+      slots.resize(capacity);
+    }
+    capacity = keys.size();
+    mask = capacity - 1;
+    std::fill(slots.begin(), slots.end(), -1);
+    count = 0;
+  }
+
+  /**
+   * Slot of a cell, or -1 if the cell has not been inserted.
+   */
+  int Find(uint64_t key) const {
+    if (count == 0) {
+      return -1;
+    }
+    size_t pos = Hash(key) & mask;
+    while (slots[pos] >= 0)
+    {
+      if (keys[pos] == key) {
+        return slots[pos];
+      }
+      pos = (pos + 1) & mask;
+    }
+    return -1;
+  }
+
+  /**
+   * Slot of a cell, inserting it as slot size() if it is new.
+   */
+  int Insert(uint64_t key) {
+    if (2 * (count + 1) > keys.size()) {
+      Grow();
+    }
+    size_t pos = Hash(key) & mask;
+    while (slots[pos] >= 0)
+    {
+      if (keys[pos] == key) {
+        return slots[pos];
+      }
+      pos = (pos + 1) & mask;
+    }
+    keys[pos] = key;
+    slots[pos] = (int)count;
+    return (int)count++;
+  }
+
+  /**
+   * Number of occupied cells.
+   */
+  size_t size() const { return count; }
+
+ private:
+  static size_t Hash(uint64_t key) {
+    // splitmix64 finalizer
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (size_t)key;
+  }
+
+  void Grow() {
+    std::vector<uint64_t> oldKeys;
+    std::vector<int> oldSlots;
+    oldKeys.swap(keys);
+    oldSlots.swap(slots);
+
+    size_t capacity = oldKeys.empty() ? 16 : 2 * oldKeys.size();
+    keys.assign(capacity, 0);
+    slots.assign(capacity, -1);
+    mask = capacity - 1;
+    for (size_t n = 0; n < oldKeys.size(); n++)
+    {
+      if (oldSlots[n] < 0) {
+        continue;
+      }
+      size_t pos = Hash(oldKeys[n]) & mask;
+      while (slots[pos] >= 0)
+      {
+        pos = (pos + 1) & mask;
+      }
+      keys[pos] = oldKeys[n];
+      slots[pos] = oldSlots[n];
+    }
+  }
+
+  std::vector<uint64_t> keys;
+  std::vector<int> slots;
+  size_t count;
+  size_t mask;
+};
+
+#endif  // SPATIAL_HASH_H_
@@ -0,0 +1,725 @@
+/**
+ * particle_filter_test.cpp
+ * Checks of filter invariants on a simulated drive through the map.
+ *
+ * Run from the repository root or the build directory (the map is read
+ * from data/map_data.txt or ../data/map_data.txt). Exits non-zero if any
+ * check fails.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "fleet_engine.h"
+#include "helper_functions.h"
+#include "particle_filter.h"
+#include "particle_filter_t.h"
+
+using std::vector;
+
+static int g_failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      g_failures++; \
+    } \
+  } while (0)
+
+static const double kDeltaT = 0.1;
+static const double kSensorRange = 50.0;
+static double sigma_pos[3] = {0.3, 0.3, 0.01};
+static double sigma_landmark[2] = {0.3, 0.3};
+
+// One frame of a straight drive along x
+struct Frame {
+  double x, y, theta;
+  double velocity, yaw_rate;
+  vector<LandmarkObs> observations;
+};
+
+/**
+ * Frames of a drive at 10 m/s from (x0, y0) heading along x, with noisy
+ *   observations of every landmark in range, 'dense' detections each.
+ */
+static vector<Frame> Drive(const Map& map, int numFrames, double x0, double y0,
+                           int dense = 1, unsigned seed = 1) {
+  std::mt19937 gen(seed);
+  std::normal_distribution<double> noise(0.0, sigma_landmark[0]);
+  vector<Frame> frames;
+  for (int t=0; t<numFrames; t++)
+  {
+    Frame f;
+    f.x = x0 + 10.0 * kDeltaT * t;
+    f.y = y0;
+    f.theta = 0.0;
+    f.velocity = 10.0;
+    f.yaw_rate = 0.0;
+    for (const auto& lm : map.landmark_list)
+    {
+      double dx = lm.x_f - f.x;
+      double dy = lm.y_f - f.y;
+      for (int k=0; k<dense && sqrt(dx * dx + dy * dy) < kSensorRange; k++)
+      {
+        LandmarkObs obs;
+        obs.id = -1;
+        obs.x = dx + noise(gen);
+        obs.y = dy + noise(gen);
+        f.observations.push_back(obs);
+      }
+    }
+    frames.push_back(f);
+  }
+  return frames;
+}
+
+// Total weight of the modes reported for the filter's current set
+static double ModeMass(ParticleFilter& pf) {
+  double mass = 0.0;
+  for (const PoseMode& mode : pf.FindModes(1000))
+  {
+    mass += mode.weight;
+  }
+  return mass;
+}
+
+/**
+ * The modes split the posterior mass, so their weights sum to at most 1,
+ *   both for the weighted set and after resampling.
+ */
+static void TestModeWeights(const Map& map) {
+  vector<Frame> frames = Drive(map, 20, 100.0, 0.0);
+  for (int multiplicity=0; multiplicity<2; multiplicity++)
+  {
+    ParticleFilter pf;
+    pf.SetNumParticles(200);
+    pf.SetMultiplicityEncoding(multiplicity != 0);
+    for (size_t t=0; t<frames.size(); t++)
+    {
+      const Frame& f = frames[t];
+      if (t == 0) {
+        pf.init(f.x, f.y, f.theta, sigma_pos);
+      } else {
+        pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+      }
+      pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+      CHECK(ModeMass(pf) <= 1.0 + 1e-9);
+      pf.resample();
+      double mass = ModeMass(pf);
+      CHECK(mass <= 1.0 + 1e-9);
+      CHECK(fabs(mass - 1.0) < 1e-9);
+    }
+  }
+}
+
+/**
+ * Under a step deadline the weighting stops at the budget and resample()
+ *   draws no more particles than were reached, growing the set back by a
+ *   quarter per step once none are shed. A budget of 1 ns is always
+ *   exceeded and one of 1000 s never is, so the checks do not depend on
+ *   the speed of the machine.
+ */
+static void TestStepDeadline(const Map& map) {
+  const int numParticles = 5000;
+  vector<Frame> frames = Drive(map, 30, 100.0, 0.0);
+  ParticleFilter pf;
+  pf.SetNumParticles(numParticles);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    const bool overrun = t < 10;
+    pf.SetStepDeadline(overrun ? 1e-6 : 1e6);
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    const int before = pf.NumParticles();
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+
+    // The particles reached are weighted, the shed ones have weight 0
+    const DeadlineStats stats = pf.GetDeadlineStats();
+    int weighted = 0;
+    for (const Particle& p : pf.particles)
+    {
+      if (p.log_weight != -HUGE_VAL) {
+        weighted++;
+      } else {
+        CHECK(p.weight == 0.0);
+      }
+    }
+    CHECK(stats.reached >= 1);
+    CHECK(stats.reached + stats.shed == before);
+    CHECK(weighted == stats.reached);
+    if (overrun) {
+      CHECK(t > 0 || stats.reached < numParticles);
+    } else {
+      CHECK(stats.shed == 0);
+    }
+
+    pf.resample();
+    const int grown = stats.shed > 0 ? stats.reached : stats.reached + std::max(1, stats.reached / 4);
+    CHECK(pf.NumParticles() == std::min(numParticles, grown));
+  }
+  CHECK(pf.NumParticles() == numParticles);
+}
+
+/**
+ * The association cache only shortcuts the nearest neighbour search: with
+ *   it the particles get the same associations and weights as without.
+ */
+static void TestAssociationCache(const Map& map) {
+  vector<Frame> frames = Drive(map, 30, 100.0, 0.0);
+  ParticleFilter cached, full;
+  cached.SetNumParticles(500);
+  full.SetNumParticles(500);
+  cached.SetAssociationCache(true);
+  full.SetAssociationCache(false);
+  double hits = 0.0;
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    ParticleFilter* pair[2] = {&cached, &full};
+    for (ParticleFilter* pf : pair)
+    {
+      if (t == 0) {
+        pf->init(f.x, f.y, f.theta, sigma_pos);
+      } else {
+        pf->prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+      }
+      pf->updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    }
+    hits += cached.AssociationCacheHitRate();
+
+    CHECK(cached.particles.size() == full.particles.size());
+    for (size_t n=0; n<cached.particles.size() && n<full.particles.size(); n++)
+    {
+      const Particle& a = cached.particles[n];
+      const Particle& b = full.particles[n];
+      CHECK(std::equal(a.associations.begin(), a.associations.end(), b.associations.begin()) &&
+            a.associations.size() == b.associations.size());
+      CHECK(a.log_weight == b.log_weight);
+      CHECK(a.weight == b.weight);
+    }
+    cached.resample();
+    full.resample();
+  }
+  CHECK(hits > 0.0);
+}
+
+/**
+ * The per-particle stages and their reductions do not depend on the thread
+ *   count: the same seeded steps on 1 and 8 threads give bit-identical
+ *   particles and weights.
+ */
+static void TestThreadCountIndependence(const Map& map) {
+  vector<Frame> frames = Drive(map, 20, 100.0, 0.0);
+  for (int field=0; field<2; field++)
+  {
+    ParticleFilter one, eight;
+    ParticleFilter* pair[2] = {&one, &eight};
+    for (ParticleFilter* pf : pair)
+    {
+      pf->SetNumParticles(2000);
+      pf->SetAugmentedMcl(true);
+      pf->SetLikelihoodField(field != 0, 0.2, 16 * 1024 * 1024);
+    }
+    one.SetNumThreads(1);
+    eight.SetNumThreads(8);
+    for (size_t t=0; t<frames.size(); t++)
+    {
+      const Frame& f = frames[t];
+      for (ParticleFilter* pf : pair)
+      {
+        if (t == 0) {
+          pf->init(f.x, f.y, f.theta, sigma_pos);
+        } else {
+          pf->prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+        }
+        pf->updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+      }
+
+      CHECK(one.particles.size() == eight.particles.size());
+      int mismatches = 0;
+      for (size_t n=0; n<one.particles.size() && n<eight.particles.size(); n++)
+      {
+        const Particle& a = one.particles[n];
+        const Particle& b = eight.particles[n];
+        if (!(a.x == b.x && a.y == b.y && a.theta == b.theta &&
+              a.log_weight == b.log_weight && a.weight == b.weight)) {
+          mismatches++;
+        }
+      }
+      CHECK(mismatches == 0);
+      CHECK(one.SummarizeWeights().ess == eight.SummarizeWeights().ess);
+      CHECK(one.GetAugmentedMclStats().log_w_fast == eight.GetAugmentedMclStats().log_w_fast);
+
+      one.resample();
+      eight.resample();
+    }
+  }
+}
+
+/**
+ * In the hybrid mode the particle count follows the mode: one particle
+ *   while the EKF runs, the full set again after it re-expands.
+ */
+static void TestHybridParticleCount(const Map& map) {
+  vector<Frame> frames = Drive(map, 40, 100.0, 0.0);
+  vector<Frame> kidnapped = Drive(map, 40, 100.0, 10.0);
+  frames.insert(frames.end(), kidnapped.begin() + 40 - 5, kidnapped.end());
+  const int numParticles = 500;
+  ParticleFilter pf;
+  pf.SetNumParticles(numParticles);
+  pf.SetHybridEkf(true);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    pf.resample();
+    const bool ekf = pf.GetHybridStats().ekf_active;
+    CHECK(pf.NumParticles() == (int)pf.particles.size());
+    CHECK(pf.NumParticles() == (ekf ? 1 : numParticles));
+  }
+  CHECK(pf.GetHybridStats().collapses > 0);
+  CHECK(pf.GetHybridStats().expansions > 0);
+}
+
+/**
+ * The policy based filter with the default policies shares the random
+ *   numbers, reductions and resampling of ParticleFilter, so from the same
+ *   seed both keep the same particles and weights.
+ */
+static void TestTemplateMatches(const Map& map) {
+  vector<Frame> frames = Drive(map, 20, 100.0, 0.0);
+  const int numParticles = 500;
+  ParticleFilter pf;
+  pf.SetNumParticles(numParticles);
+  BasicParticleFilter pft(numParticles);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+      pft.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+      pft.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    pft.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    CHECK((int)pf.particles.size() == pft.size());
+    for (int n=0; n<numParticles && n<(int)pf.particles.size(); n++)
+    {
+      CHECK(fabs(pf.particles[n].weight - pft.weight[n]) <= 1e-9 * std::max(1.0, pf.particles[n].weight));
+    }
+    pf.resample();
+    pft.resample();
+    int mismatches = 0;
+    for (int n=0; n<numParticles && n<(int)pf.particles.size(); n++)
+    {
+      const Particle& p = pf.particles[n];
+      if (fabs(p.x - pft.x[n]) > 1e-6 || fabs(p.y - pft.y[n]) > 1e-6 ||
+          fabs(p.theta - pft.theta[n]) > 1e-6) {
+        mismatches++;
+      }
+    }
+    CHECK(mismatches == 0);
+  }
+
+  // The resampling engine continues between steps: the same weights give
+  //   a new set of picks every time
+  DiscreteResampler<double> resampler;
+  vector<double> uniform(numParticles, 1.0 / numParticles);
+  vector<int> first, second;
+  resampler.Resample(uniform, numParticles, first);
+  resampler.Resample(uniform, numParticles, second);
+  CHECK(first != second);
+}
+
+/**
+ * Frames with more observations than a particle stores inline associate
+ *   and weight every observation, before and after resampling.
+ */
+static void TestManyObservations(const Map& map) {
+  vector<Frame> frames = Drive(map, 5, 100.0, 0.0, 10);
+  ParticleFilter pf;
+  pf.SetNumParticles(100);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    CHECK(f.observations.size() > 32);
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    for (const Particle& p : pf.particles)
+    {
+      CHECK(p.associations.size() == f.observations.size());
+      CHECK(p.sense_x.size() == f.observations.size());
+
+      // The log weight sums the likelihood of every association
+      double logWeight = 0.0;
+      for (size_t m=0; m<p.associations.size(); m++)
+      {
+        double lmX = 9.9e50, lmY = 9.9e50;
+        for (const auto& lm : map.landmark_list)
+        {
+          if (lm.id_i == p.associations[m]) {
+            lmX = lm.x_f;
+            lmY = lm.y_f;
+          }
+        }
+        logWeight += log_multiv_prob(sigma_landmark[0], sigma_landmark[1], p.sense_x[m], p.sense_y[m], lmX, lmY);
+      }
+      CHECK(fabs(logWeight - p.log_weight) <= 1e-9 * std::max(1.0, fabs(logWeight)));
+    }
+    pf.resample();
+    for (const Particle& p : pf.particles)
+    {
+      CHECK(p.associations.size() == f.observations.size());
+    }
+  }
+}
+
+/**
+ * An encoded set weighted before prediction shares the weighting of the
+ *   copies of a parent, but the augmented MCL averages still count every
+ *   copy: they match those of the same set unencoded.
+ */
+static void TestMultiplicityMclAverages(const Map& map) {
+  vector<Frame> frames = Drive(map, 10, 100.0, 0.0);
+  ParticleFilter encoded, plain;
+  ParticleFilter* pair[2] = {&encoded, &plain};
+  for (ParticleFilter* pf : pair)
+  {
+    pf->SetNumParticles(3000);
+    pf->SetAugmentedMcl(true);
+  }
+  encoded.SetMultiplicityEncoding(true);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    for (ParticleFilter* pf : pair)
+    {
+      if (t == 0) {
+        pf->init(f.x, f.y, f.theta, sigma_pos);
+      } else {
+        pf->prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+      }
+      pf->updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+      pf->resample();
+      // Weighted again before the next prediction, shared while encoded
+      pf->updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    }
+    const AugmentedMclStats& a = encoded.GetAugmentedMclStats();
+    const AugmentedMclStats& b = plain.GetAugmentedMclStats();
+    CHECK(fabs(a.log_w_slow - b.log_w_slow) <= 1e-9 * std::max(1.0, fabs(b.log_w_slow)));
+    CHECK(fabs(a.log_w_fast - b.log_w_fast) <= 1e-9 * std::max(1.0, fabs(b.log_w_fast)));
+    CHECK(encoded.GetDeadlineStats().reached == plain.GetDeadlineStats().reached);
+  }
+}
+
+/**
+ * An auxiliary step divides the exact likelihood of every drawn particle
+ *   by the look-ahead of its parent. Particles injected by augmented MCL
+ *   have no parent and are divided by the mean look-ahead of the drawn
+ *   ones, so their log weights differ from those of an exact weighting of
+ *   the same poses by that mean. Wide measurement noise and two
+ *   observations per frame keep the weights of random particles from
+ *   underflowing; steps where one does, and so is not divided, are skipped.
+ */
+static void TestAuxiliaryInjectedLook(const Map& map) {
+  vector<Frame> frames = Drive(map, 20, 100.0, 0.0);
+  vector<Frame> kidnapped = Drive(map, 40, 100.0, 10.0);
+  frames.insert(frames.end(), kidnapped.begin() + 20, kidnapped.end());
+  const double minLogWeight = -700.0;
+  double wide[2] = {10.0, 10.0};
+  ParticleFilter pf;
+  pf.SetNumParticles(1000);
+  pf.SetAugmentedMcl(true);
+  pf.SetObservationLimit(2);
+  int checkedSteps = 0;
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0 || pf.GetAugmentedMclStats().injection_prob == 0.0) {
+      // Plain steps until the kidnapping triggers injections
+      if (t == 0) {
+        pf.init(f.x, f.y, f.theta, sigma_pos);
+      } else {
+        pf.resample();
+        pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+      }
+      pf.updateWeights(kSensorRange, wide, f.observations, map);
+      continue;
+    }
+    pf.AuxiliaryStep(kDeltaT, sigma_pos, f.velocity, f.yaw_rate,
+                     kSensorRange, wide, f.observations, map);
+    const int numParticles = (int)pf.particles.size();
+    const int drawn = numParticles - pf.GetAugmentedMclStats().injected;
+
+    // The same poses weighted without look-ahead
+    ParticleFilter exact;
+    exact.SetNumParticles(numParticles);
+    exact.init(f.x, f.y, f.theta, sigma_pos);
+    exact.SetObservationLimit(2);
+    exact.particles = pf.particles;
+    exact.updateWeights(kSensorRange, wide, f.observations, map);
+    bool divided = drawn < numParticles && drawn > 0;
+    double sumLook = 0.0;
+    for (int n=0; n<numParticles && divided; n++)
+    {
+      divided = exact.particles[n].log_weight > minLogWeight;
+      sumLook += n < drawn ? exact.particles[n].log_weight - pf.particles[n].log_weight : 0.0;
+    }
+    if (!divided)
+    {
+      continue;
+    }
+    const double meanLook = sumLook / drawn;
+    for (int n=drawn; n<numParticles; n++)
+    {
+      double look = exact.particles[n].log_weight - pf.particles[n].log_weight;
+      CHECK(fabs(look - meanLook) <= 1e-9 * std::max(1.0, fabs(exact.particles[n].log_weight)));
+    }
+    checkedSteps++;
+  }
+  CHECK(checkedSteps > 0);
+}
+
+/**
+ * Steps that are not resampled, as in EKF mode, release their temporaries
+ *   when the next step starts.
+ */
+static void TestArenaWithoutResample(const Map& map) {
+  vector<Frame> frames = Drive(map, 200, 100.0, 0.0);
+  ParticleFilter pf;
+  pf.SetNumParticles(1000);
+  pf.SetObservationLimit(4);
+  size_t highWater = 0;
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    if (t == 1) {
+      highWater = pf.ArenaHighWater();
+    }
+  }
+  CHECK(pf.ArenaHighWater() == highWater);
+}
+
+/**
+ * With KLD-sampling both particle buffers hold the largest set, so the set
+ *   can grow to it after a kidnap without reallocating.
+ */
+static void TestKldReserve(const Map& map) {
+  vector<Frame> frames = Drive(map, 20, 100.0, 0.0);
+  vector<Frame> kidnapped = Drive(map, 20, 150.0, 20.0);
+  frames.insert(frames.end(), kidnapped.begin() + 10, kidnapped.end());
+  KldConfig config;
+  config.max_particles = 2000;
+  ParticleFilter pf;
+  pf.SetNumParticles(200);
+  pf.SetKldSampling(true, config);
+  pf.SetAugmentedMcl(true);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    pf.resample();
+    CHECK(pf.particles.capacity() >= (size_t)config.max_particles);
+  }
+}
+
+/**
+ * With repeated detections of every landmark the gated matches conflict,
+ *   and the assignment gives every landmark to at most one observation
+ *   inside its gate. Observations outside every gate keep their nearest
+ *   landmark and are not counted.
+ */
+static void TestGatedAssignment(const Map& map) {
+  vector<Frame> frames = Drive(map, 3, 100.0, 0.0, 3);
+  const double gate = 9.21;
+  ParticleFilter pf;
+  pf.SetNumParticles(200);
+  pf.SetAssignmentAssociation(true, gate);
+  for (size_t t=0; t<frames.size(); t++)
+  {
+    const Frame& f = frames[t];
+    if (t == 0) {
+      pf.init(f.x, f.y, f.theta, sigma_pos);
+    } else {
+      pf.prediction(kDeltaT, sigma_pos, f.velocity, f.yaw_rate);
+    }
+    pf.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+    CHECK(pf.GetAssociationStats().assignment_solves > 0);
+    for (const Particle& p : pf.particles)
+    {
+      CHECK(p.associations.size() == f.observations.size());
+      vector<int> ids;
+      for (size_t m=0; m<p.associations.size(); m++)
+      {
+        for (const auto& lm : map.landmark_list)
+        {
+          double dx = (p.sense_x[m] - lm.x_f) / sigma_landmark[0];
+          double dy = (p.sense_y[m] - lm.y_f) / sigma_landmark[1];
+          if (lm.id_i == p.associations[m] && dx * dx + dy * dy < gate) {
+            ids.push_back(lm.id_i);
+          }
+        }
+      }
+      std::sort(ids.begin(), ids.end());
+      CHECK(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+    }
+    pf.resample();
+  }
+}
+
+/**
+ * Early termination only drops particles: the others keep the weights of
+ *   the full update, and a dropped particle stops associating before its
+ *   last observation.
+ */
+static void TestEarlyTermination(const Map& map) {
+  vector<Frame> frames = Drive(map, 1, 100.0, 0.0, 10);
+  const Frame& f = frames[0];
+  double wideStd[3] = {2.0, 2.0, 0.05};
+  ParticleFilter full, pruning;
+  full.SetNumParticles(1000);
+  pruning.SetNumParticles(1000);
+  pruning.SetEarlyTermination(true, 20.0);
+  full.init(f.x, f.y, f.theta, wideStd);
+  pruning.init(f.x, f.y, f.theta, wideStd);
+  full.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+  pruning.updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+
+  int pruned = 0;
+  for (size_t n=0; n<full.particles.size(); n++)
+  {
+    const Particle& p = pruning.particles[n];
+    if (p.log_weight == -HUGE_VAL) {
+      pruned++;
+      CHECK(p.associations.size() < f.observations.size());
+      CHECK(full.particles[n].log_weight < 0.0);
+    } else {
+      CHECK(fabs(p.log_weight - full.particles[n].log_weight) <= 1e-9 * fabs(full.particles[n].log_weight));
+    }
+  }
+  CHECK(pruned > 0);
+  CHECK(pruned == pruning.GetAssociationStats().pruned);
+}
+
+/**
+ * The fleet engine batches only filters whose own step it reproduces, and
+ *   weights and finishes them with the observations their observation
+ *   limit keeps. Without motion noise a batched filter matches the same
+ *   filter stepped on its own, and its step and time are counted as such.
+ */
+static void TestFleetEngine(const Map& map) {
+  vector<Frame> frames = Drive(map, 1, 100.0, 0.0);
+  const Frame& f = frames[0];
+  CHECK(f.observations.size() > 4);
+  double noMotion[3] = {0.0, 0.0, 0.0};
+
+  // Filters 0 and 1 are batched, 2 weights by nearest neighbour, 3 has a
+  //   field of other settings, 4 a step deadline
+  const int numFilters = 5;
+  vector<ParticleFilter> batched(numFilters), own(numFilters);
+  for (int k=0; k<numFilters; k++)
+  {
+    ParticleFilter* pair[2] = {&batched[k], &own[k]};
+    for (ParticleFilter* pf : pair)
+    {
+      pf->SetNumParticles(100);
+      pf->SetAugmentedMcl(true);
+      pf->SetObservationLimit(k == 1 ? 4 : 0);
+      if (k != 2) {
+        pf->SetLikelihoodField(true, k == 3 ? 0.5 : 0.2, 16 * 1024 * 1024);
+      }
+      pf->SetStepDeadline(k == 4 ? 1000.0 : 0.0);
+      pf->init(f.x, f.y, f.theta, sigma_pos);
+    }
+  }
+
+  FleetEngine engine;
+  engine.SetLikelihoodField(0.2, 16 * 1024 * 1024);
+  vector<FleetSession> sessions(numFilters);
+  for (int k=0; k<numFilters; k++)
+  {
+    sessions[k].filter = &batched[k];
+    sessions[k].velocity = 0.0;
+    sessions[k].yaw_rate = 0.0;
+    sessions[k].observations = &f.observations;
+    own[k].prediction(kDeltaT, noMotion, 0.0, 0.0);
+    own[k].updateWeights(kSensorRange, sigma_landmark, f.observations, map);
+  }
+  engine.Step(sessions, kDeltaT, noMotion, kSensorRange, sigma_landmark, map);
+  CHECK(engine.BatchedSessions() == 2);
+
+  for (int k=0; k<numFilters; k++)
+  {
+    for (size_t n=0; n<own[k].particles.size(); n++)
+    {
+      double expected = own[k].particles[n].log_weight;
+      CHECK(fabs(batched[k].particles[n].log_weight - expected) <= 1e-6 * std::max(1.0, fabs(expected)));
+    }
+    const AugmentedMclStats& expected = own[k].GetAugmentedMclStats();
+    CHECK(fabs(batched[k].GetAugmentedMclStats().log_w_fast - expected.log_w_fast) <=
+          1e-6 * std::max(1.0, fabs(expected.log_w_fast)));
+    CHECK(batched[k].GetHybridStats().pf_steps == own[k].GetHybridStats().pf_steps);
+    CHECK(batched[k].GetHybridStats().pf_ms > 0.0);
+  }
+}
+
+int main() {
+  Map map;
+  if (!read_map_data("data/map_data.txt", map) &&
+      !read_map_data("../data/map_data.txt", map)) {
+    printf("Error: Could not open map file\n");
+    return 1;
+  }
+
+  TestModeWeights(map);
+  TestStepDeadline(map);
+  TestTemplateMatches(map);
+  TestAssociationCache(map);
+  TestThreadCountIndependence(map);
+  TestHybridParticleCount(map);
+  TestManyObservations(map);
+  TestMultiplicityMclAverages(map);
+  TestAuxiliaryInjectedLook(map);
+  TestArenaWithoutResample(map);
+  TestKldReserve(map);
+  TestGatedAssignment(map);
+  TestEarlyTermination(map);
+  TestFleetEngine(map);
+
+  if (g_failures > 0) {
+    printf("%d check(s) failed\n", g_failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}